@@ -0,0 +1,388 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+/** @file mapbench.cpp
+* QBENCHMARK suite for the hot paths of cacaMap.
+* It works in a temporary folder with a generated tileservers.xml and
+* synthetic caches, nothing is downloaded.
+* usage: mapbench -platform offscreen [-o results.xml,xml]
+*/
+
+#include <QtTest>
+#include "cacamap.h"
+
+/**
+* geo coords the benchmarks look at
+*/
+#define BENCH_CENTER QPointF(23.8564,61.4667)
+/**
+* zoom level the benchmarks look at
+*/
+#define BENCH_ZOOM 16
+
+class mapBench : public QObject
+{
+
+Q_OBJECT
+
+private:
+	void writeServers();
+	void writeIndex(QString const &, int);
+	void writeFiles(QString const &, int);
+	void warmView();
+	static bool removeAll(QString const &);
+
+	QString root;/**< temporary folder everything goes in. */
+	QString oldCurrent;/**< working folder to go back to. */
+	cacaMap * map;
+
+private slots:
+	void initTestCase();
+	void cleanupTestCase();
+	void updateTilesToRender();
+	void updateBuffer_data();
+	void updateBuffer();
+	void getTilePatch_data();
+	void getTilePatch();
+	void loadCache_data();
+	void loadCache();
+	void mercatorRoundTrip();
+	void mercatorBatch_data();
+	void mercatorBatch();
+	void templateExpansion();
+};
+
+/**
+* servers in the generated tileservers.xml, in order
+* the url points to the discard port so nothing would ever be downloaded
+*/
+static char const * benchServers[] = {"bench","index10k","index100k","index1m","scan10k"};
+
+/**
+* Writes a tileservers.xml with one server per synthetic cache
+*/
+void mapBench::writeServers()
+{
+	QFile file(root+"/tileservers.xml");
+	QVERIFY(file.open(QIODevice::WriteOnly));
+	QTextStream out(&file);
+	out<<"<cacamap>\n";
+	for (unsigned i=0; i<sizeof(benchServers)/sizeof(benchServers[0]); i++)
+	{
+		out<<"\t<server>\n"
+			<<"\t\t<name>"<<benchServers[i]<<"</name>\n"
+			<<"\t\t<url><![CDATA[http://127.0.0.1:9/%z/%x/%y.png]]></url>\n"
+			<<"\t\t<folder>"<<benchServers[i]<<"</folder>\n"
+			<<"\t\t<filepath><![CDATA[/%z/%x/]]></filepath>\n"
+			<<"\t\t<tile><![CDATA[%y.png]]></tile>\n"
+			<<"\t</server>\n";
+	}
+	out<<"</cacamap>\n";
+}
+
+/**
+* Creates a trusted index listing count tiles, without the files themselves
+*/
+void mapBench::writeIndex(QString const & folder, int count)
+{
+	QHash<tileKey,cacheEntry> tiles;
+	tiles.reserve(count);
+	for (int i=0; i<count; i++)
+	{
+		//a square block of tiles per zoom level, 2^16 tiles each
+		tiles.insert(tileKey(10 + i/65536,(i%65536)/256,i%256),cacheEntry(15000));
+	}
+	cacheIndex index(root+"/cache/"+folder);
+	index.rebuild(tiles);
+	index.close();
+}
+
+/**
+* Creates count tile files, and no index, so they have to be scanned
+*/
+void mapBench::writeFiles(QString const & folder, int count)
+{
+	QByteArray data(1024,'x');
+	for (int i=0; i<count; i++)
+	{
+		QString dir = QString("%1/cache/%2/%3/%4").arg(root).arg(folder).arg(10 + i/65536).arg((i%65536)/256);
+		QDir().mkpath(dir);
+		QFile file(QString("%1/%2.png").arg(dir).arg(i%256));
+		QVERIFY(file.open(QIODevice::WriteOnly));
+		file.write(data);
+	}
+}
+
+/**
+* Makes every visible %tile cached and decoded
+*/
+void mapBench::warmView()
+{
+	map->updateTilesToRender();
+	QPixmap image(map->tileSize,map->tileSize);
+	image.fill(Qt::darkGreen);
+	tileSet const & view = map->tilesToRender;
+	qint32 numtiles = 1<<view.zoom;
+	for (qint32 i = view.left; i <= view.right; i++)
+	{
+		qint32 valx = ((i<0)*numtiles + i%numtiles)%numtiles;
+		for (qint32 j = qMax(0,view.top); j <= qMin(numtiles-1,view.bottom); j++)
+		{
+			map->tileCache.insert(tileKey(view.zoom,valx,j),cacheEntry(15000));
+			map->memCache.insert(map->memCacheKey(view.zoom,valx,j),new QPixmap(image),image.width()*image.height()*image.depth()/8);
+		}
+	}
+}
+
+/**
+* Deletes a folder and everything in it
+*/
+bool mapBench::removeAll(QString const & path)
+{
+	QDir dir(path);
+	QFileInfoList entries = dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot | QDir::Hidden);
+	for (int i=0; i<entries.size(); i++)
+	{
+		if (entries.at(i).isDir())
+		{
+			removeAll(entries.at(i).filePath());
+		}
+		else
+		{
+			QFile::remove(entries.at(i).filePath());
+		}
+	}
+	return dir.rmdir(path);
+}
+
+void mapBench::initTestCase()
+{
+	root = QDir::tempPath()+QString("/cacamap-bench-%1").arg(QCoreApplication::applicationPid());
+	QVERIFY(QDir().mkpath(root));
+	writeServers();
+	writeIndex("index10k",10000);
+	writeIndex("index100k",100000);
+	writeIndex("index1m",1000000);
+	writeFiles("scan10k",10000);
+	//cacaMap reads tileservers.xml and the cache from the working folder
+	oldCurrent = QDir::currentPath();
+	QDir::setCurrent(root);
+	map = new cacaMap;
+	map->memCache.setMaxCost(512*1024*1024);
+	map->geocoords = BENCH_CENTER;
+	map->setZoom(BENCH_ZOOM);
+	map->resize(800,600);
+	delete map->imgBuffer;
+	map->imgBuffer = new QPixmap(map->size());
+}
+
+void mapBench::cleanupTestCase()
+{
+	delete map;
+	QDir::setCurrent(oldCurrent);
+	removeAll(root);
+}
+
+void mapBench::updateTilesToRender()
+{
+	QBENCHMARK
+	{
+		map->updateTilesToRender();
+	}
+}
+
+void mapBench::updateBuffer_data()
+{
+	QTest::addColumn<QSize>("size");
+	QTest::newRow("320x240") << QSize(320,240);
+	QTest::newRow("800x600") << QSize(800,600);
+	QTest::newRow("1920x1080") << QSize(1920,1080);
+	QTest::newRow("3840x2160") << QSize(3840,2160);
+}
+
+/**
+* Full redraw of the buffer with every %tile decoded already
+*/
+void mapBench::updateBuffer()
+{
+	QFETCH(QSize,size);
+	map->resize(size);
+	delete map->imgBuffer;
+	map->imgBuffer = new QPixmap(size);
+	warmView();
+	//the first pass gives the tiles their expiry
+	map->updateBuffer();
+	QBENCHMARK
+	{
+		map->updateBuffer();
+	}
+	map->resize(800,600);
+}
+
+void mapBench::getTilePatch_data()
+{
+	QTest::addColumn<int>("depth");
+	for (int depth=1; depth<=8; depth++)
+	{
+		QTest::newRow(QString("depth %1").arg(depth).toLatin1()) << depth;
+	}
+}
+
+/**
+* Patch for a missing %tile whose closest decoded ancestor is depth levels up
+* Past PYRAMID_DEPTH levels the patch would be too small, that's the cost of giving up.
+*/
+void mapBench::getTilePatch()
+{
+	QFETCH(int,depth);
+	quint32 x = 37543, y = 18234;
+	map->tileCache.clear();
+	map->memCache.clear();
+	map->pyramid.clear();
+	map->pyramidKeys.clear();
+	QPixmap image(map->tileSize,map->tileSize);
+	image.fill(Qt::darkGreen);
+	int level = BENCH_ZOOM - depth;
+	map->tileCache.insert(tileKey(level,x>>depth,y>>depth),cacheEntry(15000));
+	map->memCache.insert(map->memCacheKey(level,x>>depth,y>>depth),new QPixmap(image),image.width()*image.height()*image.depth()/8);
+	bool found = false;
+	QBENCHMARK
+	{
+		QPixmap patch;
+		found = map->getTilePatch(BENCH_ZOOM,x,y,0,0,map->tileSize,patch);
+	}
+	QCOMPARE(found,depth <= PYRAMID_DEPTH);
+}
+
+void mapBench::loadCache_data()
+{
+	QTest::addColumn<int>("server");
+	QTest::addColumn<int>("tiles");
+	QTest::addColumn<bool>("scan");
+	QTest::newRow("index 10k") << 1 << 10000 << false;
+	QTest::newRow("index 100k") << 2 << 100000 << false;
+	QTest::newRow("index 1M") << 3 << 1000000 << false;
+	QTest::newRow("scan 10k") << 4 << 10000 << true;
+}
+
+/**
+* Loading the cache of a server, through setServer() so the index is closed
+* cleanly between runs like it is when switching servers
+* A scan writes the index, so only its first run is measured.
+*/
+void mapBench::loadCache()
+{
+	QFETCH(int,server);
+	QFETCH(int,tiles);
+	QFETCH(bool,scan);
+	if (scan)
+	{
+		QBENCHMARK_ONCE
+		{
+			map->setServer(server);
+		}
+	}
+	else
+	{
+		QBENCHMARK
+		{
+			map->setServer(server);
+		}
+	}
+	QCOMPARE(map->tileCache.size(),tiles);
+	map->setServer(0);
+}
+
+/**
+* geo coords to pixels and back, for a grid of 100x100 points
+*/
+void mapBench::mercatorRoundTrip()
+{
+	QVector<QPointF> points;
+	for (int i=0; i<100; i++)
+	{
+		for (int j=0; j<100; j++)
+		{
+			points.append(QPointF(-180.0 + i*3.6,-85.0 + j*1.7));
+		}
+	}
+	qreal checksum = 0;
+	QBENCHMARK
+	{
+		for (int i=0; i<points.size(); i++)
+		{
+			longPoint p = myMercator::geoCoordToPixel(points.at(i),BENCH_ZOOM,256);
+			checksum += myMercator::pixelToGeoCoord(p,BENCH_ZOOM,256).x();
+		}
+	}
+	QVERIFY(checksum != 0);
+}
+
+/**
+* 1M geo coords to pixels and back with the batch functions, as an overlay would each frame
+*/
+void mapBench::mercatorBatch_data()
+{
+	QTest::addColumn<int>("level");
+	QTest::newRow("z16") << 16;
+	QTest::newRow("z24") << 24;
+}
+
+void mapBench::mercatorBatch()
+{
+	QFETCH(int,level);
+	int const count = 1000000;
+	QVector<qreal> lon(count), lat(count), lon2(count), lat2(count);
+	QVector<qint64> x(count), y(count);
+	for (int i=0; i<count; i++)
+	{
+		lon[i] = -180.0 + (i%1000)*0.36;
+		lat[i] = -85.0 + (i/1000)*0.17;
+	}
+	QBENCHMARK
+	{
+		myMercator::geoCoordToPixel(lon.constData(),lat.constData(),x.data(),y.data(),count,level,256);
+		myMercator::pixelToGeoCoord(x.constData(),y.constData(),lon2.data(),lat2.data(),count,level,256);
+	}
+	//a pixel at level 16 is ~2e-5 degrees wide
+	QVERIFY(qAbs(lon2.at(count/2) - lon.at(count/2)) < 1e-3);
+	QVERIFY(qAbs(lat2.at(count/2) - lat.at(count/2)) < 1e-3);
+}
+
+/**
+* url, path and file name of 10000 tiles
+*/
+void mapBench::templateExpansion()
+{
+	servermanager & servermgr = map->servermgr;
+	QString buffer;
+	buffer.reserve(256);
+	int checksum = 0;
+	QBENCHMARK
+	{
+		for (int i=0; i<10000; i++)
+		{
+			buffer.resize(0);
+			servermgr.appendTileUrl(buffer,BENCH_ZOOM,i,i*7);
+			servermgr.appendFilePath(buffer,BENCH_ZOOM,i);
+			servermgr.appendFileName(buffer,i*7);
+			checksum += buffer.size();
+		}
+	}
+	QVERIFY(checksum > 0);
+}
+
+QTEST_MAIN(mapBench)
+#include "mapbench.moc"
@@ -0,0 +1,16 @@
+######################################################################
+# QtTest benchmarks of rendering, patches, cache loading and projections
+# run with: ./mapbench -platform offscreen -o results.xml,xml
+######################################################################
+
+TEMPLATE = app
+TARGET = mapbench
+CONFIG += qt console testcase
+CONFIG -= app_bundle
+QT += network xml testlib
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+DEPENDPATH += . ..
+INCLUDEPATH += ..
+# Input
+HEADERS += ../cacamap.h ../servermanager.h ../mercator.h ../tilekey.h ../tileloader.h ../tilewriter.h ../cacheindex.h ../packstore.h ../metastore.h ../mapmetrics.h ../throttle.h
+SOURCES += mapbench.cpp ../cacamap.cpp ../servermanager.cpp ../mercator.cpp ../tileloader.cpp ../tilewriter.cpp ../cacheindex.cpp ../packstore.cpp ../metastore.cpp ../mapmetrics.cpp ../throttle.cpp
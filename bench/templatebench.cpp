@@ -0,0 +1,110 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+/** @file templatebench.cpp
+* Compares the old QString::replace() based url expansion
+* with the precompiled templates in servermanager.
+* usage: templatebench [tileservers.xml] [iterations]
+*/
+
+#include <QtCore>
+#include <QtXml>
+#include <iostream>
+#include "servermanager.h"
+using namespace std;
+
+/**
+* url expansion as it was done before templates were compiled
+*/
+static QString legacyTileUrl(QString const & tmpl, int zoom, quint32 x, quint32 y)
+{
+	QString sz,sx,sy;
+	sz.setNum(zoom);
+	sx.setNum(x);
+	sy.setNum(y);
+	QString urltmpl = tmpl;
+
+	urltmpl.replace(QString("%z"),sz);
+	urltmpl.replace(QString("%x"),sx);
+	urltmpl.replace(QString("%y"),sy);
+	return urltmpl;
+}
+
+/**
+* @return url templates in the xml file, in server order
+*/
+static QStringList urlTemplates(QString const & xmlfile)
+{
+	QStringList list;
+	QDomDocument doc("mydocument");
+	QFile file(xmlfile);
+	if (file.open(QIODevice::ReadOnly) && doc.setContent(&file))
+	{
+		QDomNodeList servers = doc.elementsByTagName("server");
+		for (int i=0; i< (int)servers.length(); i++)
+		{
+			list.append(servers.item(i).namedItem("url").firstChild().toCDATASection().data());
+		}
+	}
+	return list;
+}
+
+int main(int argc, char ** argv)
+{
+	QCoreApplication app(argc, argv);
+	QString xmlfile = argc > 1 ? argv[1] : "../tileservers.xml";
+	int iterations = argc > 2 ? atoi(argv[2]) : 1000000;
+
+	servermanager servermgr;
+	if (!servermgr.loadConfigFile(xmlfile))
+	{
+		cout<<"error loading server file."<<endl;
+		return 1;
+	}
+	QStringList templates = urlTemplates(xmlfile);
+	QStringList names = servermgr.getServerNames();
+	//keeps the compiler from throwing the results away
+	int checksum = 0;
+
+	for (int s=0; s<names.size() && s<templates.size(); s++)
+	{
+		servermgr.selectServer(s);
+		QElapsedTimer timer;
+
+		timer.start();
+		for (int i=0; i<iterations; i++)
+		{
+			checksum += legacyTileUrl(templates.at(s),18,i,i*7).size();
+		}
+		qint64 legacy = qMax(timer.elapsed(),(qint64)1);
+
+		QString buffer;
+		buffer.reserve(256);
+		timer.start();
+		for (int i=0; i<iterations; i++)
+		{
+			buffer.resize(0);
+			servermgr.appendTileUrl(buffer,18,i,i*7);
+			checksum += buffer.size();
+		}
+		qint64 compiled = qMax(timer.elapsed(),(qint64)1);
+
+		cout<<names.at(s).toStdString()<<": "
+			<<(qint64)iterations*1000/legacy<<" expansions/s before, "
+			<<(qint64)iterations*1000/compiled<<" expansions/s after ("
+			<<(double)legacy/compiled<<"x)"<<endl;
+	}
+	return checksum == 0;
+}
@@ -0,0 +1,15 @@
+######################################################################
+# Microbenchmark for servermanager url/path template expansion
+######################################################################
+
+TEMPLATE = app
+TARGET = templatebench
+CONFIG += qt console
+CONFIG -= app_bundle
+QT += xml
+QT -= gui
+DEPENDPATH += . ..
+INCLUDEPATH += ..
+# Input
+HEADERS += ../servermanager.h
+SOURCES += templatebench.cpp ../servermanager.cpp
@@ -14,78 +14,13 @@ GNU General Public License for more details.
 */
 
 #include "cacamap.h"
+#include <algorithm>
+#include <cstdio>
 
 using namespace std;
 /**
 * constructor
 */
-longPoint::longPoint(quint32 _x, quint32 _y)
-{
-	x = _x;
-	y = _y;
-}
-/**
-*empty constructor
-*/
-
-longPoint::longPoint()
-{
-	x = 0;
-	y = 0;
-}
-
-/**
-* Converts a geo coordinate to map pixels
-* @param geocoord has the longitude and latitude in degrees.
-* @param zoom is the zoom level, ranges from cacaMap::minZoom (out) to maxZoom (in).
-* @param tilesize the width/height in px of the square %tile (e.g 256).
-* @return a longpoint struct containing the x and y px coordinates
-* in the map for the given geocoordinates and zoom level.
-*/
-longPoint myMercator::geoCoordToPixel(QPointF const &geocoord, int zoom, int tilesize)
-{
- 	qreal  longitude = geocoord.x();
-	qreal  latitude = geocoord.y();
-	
-	//height, width of the whole map,this is, all tiles for a given zoom level put together
-	quint32 mapsize =  (1<<zoom)*tilesize;
-	
-	qreal latitude_m = atanh(sin(latitude/180.0*M_PI))*180.0/M_PI;
-
-	quint32 x = mapsize*(longitude + 180.0)/360.0;
-	
-	quint32 y = mapsize*(180.0 - latitude_m)/360.0;
-	
-	return longPoint(x,y);
-}
-/**
-* Converts  map pixels to geo coordinates in degrees
-* @param pixelcoord has the x and y px coordinates.
-* @param zoom  is the zoom level, ranges from 0(out) to 18(in).
-* @param tilesize the width/height in px of the square %tile (e.g 256).
-* @return a QPointF object containing the latitude and longitude of 
-* of the given location.
-*/
-
-QPointF myMercator::pixelToGeoCoord(longPoint const &pixelcoord, int zoom, int tilesize)
-{
-	long  x= pixelcoord.x;
-	long  y= pixelcoord.y;
-	
-	//height, width of the whole map,this is, all tiles for a given zoom level put together
-	quint32 mapsize =  (1<<zoom)*tilesize;
-
-	
-	qreal longitude = x*360.0/mapsize - 180.0;
-	
-	qreal latitude_m = 180.0 - y*360.0/mapsize;
-	qreal latitude = asin(tanh(latitude_m*M_PI/180.0))*180/M_PI;
-	
-	return QPointF(longitude,latitude);
-}
-/**
-* constructor
-*/
 cacaMap::cacaMap(QWidget* parent):QWidget(parent)
 {
 	cout<<"cacamap constructor"<<endl;
@@ -94,21 +29,73 @@ cacaMap::cacaMap(QWidget* parent):QWidget(parent)
 		std::cout<<"error loading server file."<<std::endl;
 	}
 	cacheSize = 0;
-	maxZoom = 18;
+	maxZoom = servermgr.maxZoom();
 	minZoom = 0;
 	folder = QDir::currentPath();
+	currentIndex = 0;
+	currentPack = 0;
+	currentMeta = 0;
+	currentTime = metaStore::now();
+	cacheLimitBytes = CACHE_MAX_DEFAULT;
+	cacheLimitTiles = 0;
+	policy = LRU;
+	accessTick = 0;
+	evictionNext = 0;
+	evictionTimer = new QTimer(this);
+	evictionTimer->setSingleShot(true);
+	evictionTimer->setInterval(EVICT_INTERVAL);
+	connect(evictionTimer,SIGNAL(timeout()),this,SLOT(slotEvict()));
+	tilesToRender = tileSet();
 	loadCache();
+	if (overQuota())
+	{
+		evictionTimer->start();
+	}
 	geocoords = QPointF(23.8564,61.4667);
-	downloading = false;
 	tileSize = 256;
 	zoom = 14;
 	manager = new QNetworkAccessManager(this);
+	connect(manager, SIGNAL(finished(QNetworkReply*)),this, SLOT(slotDownloadReady(QNetworkReply*)));
+	writer.start(QThread::LowPriority);
+	maxDownloads = servermgr.connectionsCeiling();
+	shardDownloads.fill(0,servermgr.shardCount());
+	mirrorDownloads.fill(0,servermgr.mirrorCount());
+	currentThrottle = 0;
+	selectThrottle();
+	throttleTimer = new QTimer(this);
+	throttleTimer->setSingleShot(true);
+	connect(throttleTimer,SIGNAL(timeout()),this,SLOT(slotRetry()));
+	timeoutTimer = new QTimer(this);
+	timeoutTimer->setInterval(TIMEOUT_CHECK_INTERVAL);
+	connect(timeoutTimer,SIGNAL(timeout()),this,SLOT(slotTimeouts()));
+	hedgeTimer = new QTimer(this);
+	hedgeTimer->setInterval(HEDGE_CHECK_INTERVAL);
+	connect(hedgeTimer,SIGNAL(timeout()),this,SLOT(slotHedge()));
+	queueDirty = false;
+	prefetchMax = PREFETCH_TILES_DEFAULT;
+	prefetchBandwidth = PREFETCH_BANDWIDTH_DEFAULT;
+	prefetchBytes = 0;
+	prefetchClock.start();
+	prefetchLevel = zoom;
 	loadingAnim.setFileName("loading.gif");
 	loadingAnim.setScaledSize(QSize(tileSize,tileSize));
 	loadingAnim.start();
 	notAvailableTile.load("notavailable.jpeg");
 	imgBuffer = new QPixmap(size());
-	buffzoomrate = 1.0;
+	bufferDirty = true;
+	fractionalZoom = zoom;
+	contentDirty = false;
+	panPending = false;
+	frameTimer = new QTimer(this);
+	frameTimer->setSingleShot(true);
+	frameTimer->setInterval(FRAME_INTERVAL);
+	connect(frameTimer,SIGNAL(timeout()),this,SLOT(slotFrame()));
+	memCache.setMaxCost(MEMCACHE_MAX);
+	patchCache.setMaxCost(PATCHCACHE_MAX);
+	netClock.start();
+	metricsTimer = new QTimer(this);
+	connect(metricsTimer,SIGNAL(timeout()),this,SLOT(slotMetrics()));
+	setMetricsInterval(METRICS_INTERVAL_DEFAULT);
 }
 
 /**
@@ -120,6 +107,7 @@ void cacaMap::setGeoCoords(QPointF newcoords)
 	//geocoords.setX(newcoords.x());
 	//geocoords.setY(newcoords.y());
 	geocoords = newcoords;
+	scheduleUpdate();
 }
 /**
 * zooms in one level
@@ -129,10 +117,7 @@ bool cacaMap::zoomIn()
 {
 	if (zoom < maxZoom)
 	{
-		zoom++;
-		downloadQueue.clear();
-		updateContent();
-		return true;
+		return setZoom((double)(zoom+1));
 	}
 	return false;
 }
@@ -142,12 +127,14 @@ bool cacaMap::zoomIn()
 */
 bool cacaMap::zoomOut()
 {
+	//from a fractional level go back to the integer one first
+	if (fractionalZoom > zoom)
+	{
+		return setZoom((double)zoom);
+	}
 	if (zoom > minZoom)
 	{
-		zoom--;
-		downloadQueue.clear();
-		updateContent();
-		return true;
+		return setZoom((double)(zoom-1));
 	}
 	return false;
 }
@@ -157,12 +144,33 @@ bool cacaMap::zoomOut()
 * @return true if it is a valid level, false otherwise (if level is outside the valid range)
 */
 bool cacaMap::setZoom(int level)
+{
+	return setZoom((double)level);
+}
+
+/**
+* zooms to a fractional level, for smooth zoom animations
+* Tiles of the integer part of the level are drawn magnified, and the ones
+* of the next level that are available already fade in over them.
+* @return true if it is a valid level, false otherwise (if level is outside the valid range)
+*/
+bool cacaMap::setZoom(double level)
 {
 	if (level>= minZoom && level <= maxZoom)
 	{
-		zoom = level;
-		downloadQueue.clear();
-		updateContent();
+		int base = qFloor(level);
+		fractionalZoom = level;
+		if (base != zoom)
+		{
+			zoom = base;
+			bufferDirty = true;
+		}
+		scheduleUpdate();
+		//get the next level ready while heading there
+		if (fractionalZoom > zoom && prefetchLevel != zoom+1)
+		{
+			prefetchZoom(geocoords,zoom+1);
+		}
 		return true;
 	}
 	return false;
@@ -183,16 +191,51 @@ QStringList cacaMap::getServerNames()
 	return servermgr.getServerNames();		
 }
 /**
-* Change tile server to the one in index
+* Change tile server to the one in index, serverChanged() is emitted once it is loaded
 */
 void cacaMap::setServer(int index)
 {
+	//the old folder's index is left in a trustworthy state
+	if (currentIndex)
+	{
+		currentIndex->close();
+	}
+	currentMeta->close();
 	servermgr.selectServer(index);
 	downloadQueue.clear();
+	downloadOrder.clear();
+	//requests for the old server are of no use anymore
+	QList<QNetworkReply*> replies = activeDownloads.keys();
+	for (int i=0; i<replies.size(); i++)
+	{
+		replies.at(i)->abort();
+	}
+	maxDownloads = servermgr.connectionsCeiling();
+	selectThrottle();
+	maxZoom = servermgr.maxZoom();
+	if (fractionalZoom > maxZoom)
+	{
+		zoom = maxZoom;
+		fractionalZoom = maxZoom;
+	}
+	//requests to the old server keep their slot until they finish
+	while (shardDownloads.size() < servermgr.shardCount())
+	{
+		shardDownloads.append(0);
+	}
+	while (mirrorDownloads.size() < servermgr.mirrorCount())
+	{
+		mirrorDownloads.append(0);
+	}
 	loadCache();
-	downloading = false;
-	updateContent();
-	update();
+	if (overQuota())
+	{
+		evictionTimer->start();
+	}
+	bufferDirty = true;
+	scheduleUpdate();
+	//the zoom range may be different
+	emit serverChanged();
 }
 /**
 *   @return current zoom level
@@ -200,331 +243,1531 @@ void cacaMap::setServer(int index)
 int cacaMap::getZoom()
 {
 	return zoom;
+}
+
+/**
+* @return the zoom level including the fraction, getZoom() is its integer part
+*/
+double cacaMap::getFractionalZoom()
+{
+	return fractionalZoom;
 }	
 
 /**
-*@param zoom zoom level
-*@param x tile x column
-*@return string with the path to the folder containing the tiles in 
-*for zoom level and x column
+* Sets the memory budget for decoded tiles
+* @param bytes maximum number of bytes the in-memory %tile cache may use
 */
-QString cacaMap::getTilePath(int zoom,qint32 x)
+void cacaMap::setMemCacheSize(int bytes)
 {
-	return "cache/"+servermgr.tileCacheFolder()+servermgr.filePath(zoom,x);
+	memCache.setMaxCost(bytes);
 }
 
 /**
-* @return image for temporarily replacing a tile that is downloading and currently unavailable
-* The 'patch' is a subsection of an available tile from a lower zoom level.
-* The algorithm tries to find a suitable tile starting from level zoom -1, until level 0.
-* The higher the zoom level difference the more pixelated the patch will be.
+* @return number of %tile lookups served from the in-memory cache
 */
-QPixmap cacaMap::getTilePatch(int zoom, quint32 x, quint32 y, int offx, int offy, int tsize)
+quint64 cacaMap::getMemCacheHits()
 {
-	//dont go beyond level 0 and 
-	//dont use patches smaller than 16 px. They are unintelligible anyways.
-	if (zoom>0 && tsize>=16*2)
-	{
-		int parentx, parenty, offsetx, offsety;
-		QString tileid;
-		QPixmap patch;
-		QString sz,sx,sy;
-		parentx = x/2;
-		parenty = y/2;
-		sz.setNum(zoom-1);
-		sx.setNum(parentx);
-		sy.setNum(parenty);
-		offsetx = offx/2 + (x%2)*tileSize/2;
-		offsety = offy/2 + (y%2)*tileSize/2;
-		tileid = sz+"."+sx+"."+sy;
-		if (tileCache.contains(tileid))
-		{
-			//render the tile
-			QDir::setCurrent(folder);
-			QString path= getTilePath(zoom-1,parentx) ;
-			QString fileName = servermgr.fileName(parenty);
-			QDir::setCurrent(path);
-			QFile f(fileName);
-			if (f.open(QIODevice::ReadOnly))
-			{
-				patch.loadFromData(f.readAll());
-				f.close();
-				return patch.copy(offsetx,offsety,tsize/2,tsize/2).scaledToHeight(tileSize);
-			}
-			else
-			{
-				cout<<"no file found "<<path.toStdString()<<fileName.toStdString()<<endl;
-			}
-		}
-		else
-		{
-			return getTilePatch(zoom-1,parentx,parenty,offsetx,offsety,tsize/2);
-		}
-	}
-	return loadingAnim.currentPixmap();
+	return metrics.memHits;
 }
 
+/**
+* @return number of %tile lookups that had to read and decode a file from HDD
+*/
+quint64 cacaMap::getMemCacheMisses()
+{
+	return metrics.memMisses;
+}
 
+/**
+* @return counters and histograms of the time spent reading, decoding, drawing and downloading tiles
+* since the last resetMetrics()
+*/
+mapMetrics const & cacaMap::getMetrics()
+{
+	return metrics;
+}
 
 /**
-Starts downloading the next %tile in the queue
-@see cacaMap::downloadQueue
+* @return getMetrics() as a json object, times in us
 */
-void cacaMap::downloadPicture()
+QString cacaMap::getMetricsJson()
+{
+	return metrics.toJson();
+}
+
+/**
+* Sets every metric back to 0
+*/
+void cacaMap::resetMetrics()
+{
+	metrics.reset();
+}
+
+/**
+Reports the metrics periodically
+@param ms time between metricsUpdated() signals, 0 stops them
+@param dumpFile file the metrics are written to as json every time, none if it's empty
+*/
+void cacaMap::setMetricsInterval(int ms, QString const & dumpFile)
 {
-	//check if there isnt an active download already
-	if (!downloading)
+	metricsFile = dumpFile;
+	if (ms > 0)
 	{
-		//there are items in the queue
-		if (downloadQueue.size())
-		{
-			downloading = true;
-			QHash<QString,tile>::const_iterator i;
-			i = downloadQueue.constBegin();
-			tile nextItem = i.value();
-			QString surl = nextItem.url;
-			QNetworkRequest request;
-			request.setUrl(QUrl(surl));
-			QNetworkReply *reply = manager->get(request);
-			connect(reply, SIGNAL(error(QNetworkReply::NetworkError)),this, SLOT(slotError(QNetworkReply::NetworkError)));
-			connect(manager, SIGNAL(finished(QNetworkReply*)),this, SLOT(slotDownloadReady(QNetworkReply*)));
-			connect(reply, SIGNAL(downloadProgress(qint64,qint64)),this, SLOT(slotDownloadProgress(qint64, qint64)));
-		}
-		else
-		{
-		//	cout<<"no items in the queue"<<endl;
-		}
+		metricsTimer->start(ms);
 	}
 	else
 	{
-		cout<<"another download is already in progress... "<<endl;
+		metricsTimer->stop();
 	}
 }
+
 /**
-Populates the cache list by checking the existing files on the cache folder
+Limits how much is downloaded ahead of the view
+@param tiles maximum number of prefetched tiles queued or downloading, 0 disables prefetching
+@param bytesPerSec bandwidth allowed for prefetching, 0 for no limit
 */
-void cacaMap::loadCache()
+void cacaMap::setPrefetchBudget(int tiles, int bytesPerSec)
 {
-	cacheSize=0;
-	unavailableTiles.clear();
-	tileCache.clear();
-	QDir::setCurrent(folder);
-	QDir dir;
-	if (dir.cd("cache"))
+	prefetchMax = qMax(0,tiles);
+	prefetchBandwidth = qMax(0,bytesPerSec);
+	if (!prefetchMax)
 	{
-		if (dir.cd(servermgr.tileCacheFolder()))
+		//drop the prefetched tiles that haven't started
+		QHash<tileKey,tile>::iterator i = downloadQueue.begin();
+		while (i != downloadQueue.end())
 		{
-			QStringList zoom = dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot);
-			QString zoomLevel;
-			for(int i=0; i< zoom.size(); i++)
+			if (i.value().prefetch && !i.value().reply)
 			{
-				zoomLevel = zoom.at(i);
-				dir.cd(zoomLevel);
-				QStringList longitudes = dir.entryList(QDir::Dirs|QDir::NoDotAndDotDot);
-				QString lon;
-				for(int j=0; j< longitudes.size(); j++)
-				{
-					lon = longitudes.at(j);
-					dir.cd(lon);
-					QFileInfoList latitudes = dir.entryInfoList(QDir::Files|QDir::NoDotAndDotDot);
-					QString lat;
-					for(int k=0; k< latitudes.size(); k++)
-					{
-						lat = latitudes.at(k).baseName();
-						cacheSize+= latitudes.at(k).size();
-						QString name = zoomLevel+"."+lon+"."+lat;
-						tileCache.insert(name,1);
-					}
-					dir.cdUp();//go back to zoom level folder
-				}
-				dir.cdUp();//go back to tile folder
+				i = downloadQueue.erase(i);
+			}
+			else
+			{
+				++i;
 			}
 		}
-		QDir::setCurrent(folder);
-		cout<<"cache size "<<(float)cacheSize/1024/1024<<" MB"<<endl;
+		queueDirty = true;
 	}
+	downloadPicture();
 }
 
 /**
-Slot to keep track of download progress
+* Sets how many %tile requests can be in flight at the same time to each host
+* This overrides the value in the server's maxconnections tag until the server is changed.
+* The server's throttle can still allow fewer.
 */
-void cacaMap::slotDownloadProgress(qint64 _bytesReceived, qint64 _bytesTotal)
+void cacaMap::setMaxDownloads(int max)
 {
+	if (max > 0)
+	{
+		maxDownloads = max;
+		downloadPicture();
+	}
 }
 
 /**
-* Slot that gets called everytime a %tile download request finishes
-* Saves image file to HDD, takes out item from download queue, and  adds item to cache list
+*@param zoom zoom level
+*@param x tile x column
+*@return string with the path to the folder containing the tiles in 
+*for zoom level and x column
 */
-void cacaMap::slotDownloadReady(QNetworkReply * _reply)
+QString cacaMap::getTilePath(int zoom,qint32 x)
 {
-	QNetworkReply::NetworkError error = _reply->error();
-	//get url of original request 
-	QNetworkRequest req = _reply->request();
-	QUrl url = req.url();
-	QString surl = url.toString();
-	bool found = false;
-	QHash<QString,tile>::const_iterator i;
-	i = downloadQueue.constBegin();
-	
-	for( i; i!=downloadQueue.constEnd();i++)
+	QString path;
+	path.reserve(64);
+	path += "cache/";
+	path += servermgr.tileCacheFolder();
+	servermgr.appendFilePath(path,zoom,x);
+	return path;
+}
+
+/**
+* @return absolute path of the file of a %tile
+*/
+QString cacaMap::getTileFile(int zoom, quint32 x, quint32 y)
+{
+	QString path;
+	path.reserve(folder.size()+96);
+	path += folder;
+	path += "/cache/";
+	path += servermgr.tileCacheFolder();
+	servermgr.appendFilePath(path,zoom,x);
+	servermgr.appendFileName(path,y);
+	return path;
+}
+
+/**
+* @return id of a %tile in the in-memory cache, it includes the server
+*/
+tileKey cacaMap::memCacheKey(int zoom, quint32 x, quint32 y)
+{
+	return tileKey(zoom,x,y,servermgr.serverIndex());
+}
+
+/**
+* Gets the decoded image of a cached %tile.
+* Looks in the in-memory LRU first. On a miss the file is read and decoded
+* in a worker thread and the %tile gets redrawn once it's ready.
+* @param zoom zoom level
+* @param x %tile column
+* @param y %tile row
+* @param image is set to the %tile image if found
+* @return true if the image is available right away, false otherwise
+* @see cacaMap::slotTileDecoded
+*/
+bool cacaMap::loadTile(int zoom, quint32 x, quint32 y, QPixmap &image)
+{
+	QHash<tileKey,cacheEntry>::iterator entry = tileCache.find(tileKey(zoom,x,y));
+	if (entry != tileCache.end())
 	{
-		if (i.value().url == surl)
-		{
-			found = true;
-			break;
-		}
+		entry.value().lastAccess = accessTick;
+		entry.value().hits++;
 	}
-
-	if (error == QNetworkReply::NoError)
+	tileKey tileid = memCacheKey(zoom,x,y);
+	QPixmap * cached = memCache.object(tileid);
+	if (cached)
 	{
-		qint64 bytes = _reply->bytesAvailable();
-
-		if (bytes)
+		metrics.memHits++;
+		image = *cached;
+		return true;
+	}
+	metrics.memMisses++;
+	if (!pendingDecodes.contains(tileid))
+	{
+		pendingDecodes.insert(tileid);
+		if (currentPack)
 		{
-			//get url of original request 
-			QNetworkRequest req = _reply->request();
-			QUrl url = req.url();
-			QString surl = url.toString();
-			cacheSize+=bytes;
-			//get image data
-			QByteArray data = _reply->readAll();		
-			if (found)
+			//it might not be in the pack yet
+			QByteArray data = writer.pending(currentPack->jobPath(tileKey(zoom,x,y)));
+			if (data.isEmpty())
 			{
-				tile nextItem = i.value();
-				QString kk = i.key();
-				QString zdir = QString().setNum(nextItem.zoom);
-				QString xdir = QString().setNum(nextItem.x);
-				QString tilefile = servermgr.fileName(nextItem.y);
-
-				QDir::setCurrent(folder);
-				QDir dir;
-				if (!dir.exists("cache"))
-				{
-					dir.mkdir("cache");
-				}
-				dir.cd("cache");
-				if (!dir.exists(servermgr.tileCacheFolder()))
-				{
-					dir.mkdir(servermgr.tileCacheFolder());
-				}
-				dir.cd(servermgr.tileCacheFolder());
-
-				if(!dir.exists(zdir))
-				{
-					dir.mkdir(zdir);	
-				}
-				dir.cd(zdir);
-				if(!dir.exists(xdir))
-				{
-					dir.mkdir(xdir);	
-				}
-				dir.cd(xdir);
-				
-				QDir::setCurrent(dir.path());
-				QFile f(tilefile);
-				f.open(QIODevice::WriteOnly);
-				quint64 byteswritten = f.write(data);
-				if (byteswritten <= 0)
-				{
-					cout<<"error writing to file "<<f.fileName().toStdString()<<endl;
-				}
-				f.close();
-				//remove item from download queue
-				downloadQueue.remove(i.key());
-				
-				//add it to cache
-				tileCache.insert(kk,1);
-				//update with new tile
-				updateBuffer();
-				update();
+				decoderPool.start(new tileLoader(this,tileid.id,currentPack,tileKey(zoom,x,y)));
 			}
 			else
 			{
-				cout<<"downloaded tile "<<surl.toStdString()<<" was not in Download queue. Data ignored"<<endl;
+				decoderPool.start(new tileLoader(this,tileid.id,data));
 			}
-			downloading = false;
-			downloadPicture();
-			
+			return false;
+		}
+		QString fileName = getTileFile(zoom,x,y);
+		//it might not be on HDD yet
+		QByteArray data = writer.pending(fileName);
+		if (data.isEmpty())
+		{
+			decoderPool.start(new tileLoader(this,tileid.id,fileName));
 		}
 		else
 		{
-			//cout<<"no data"<<endl;
+			decoderPool.start(new tileLoader(this,tileid.id,data));
 		}
-		update();
 	}
-	else
+	return false;
+}
+
+/**
+* Finds an image for temporarily replacing a tile that is downloading and currently unavailable
+* The 'patch' is a subsection of an available tile from a lower zoom level.
+* The algorithm tries to find a suitable tile starting from level zoom -1, until level 0.
+* The higher the zoom level difference the more pixelated the patch will be.
+* Pinned ancestors are used before anything that would need a decode.
+* @param image gets the patch
+* @return false if no ancestor is available yet
+*/
+bool cacaMap::getTilePatch(int zoom, quint32 x, quint32 y, int offx, int offy, int tsize, QPixmap & image)
+{
+	//dont go beyond level 0 and 
+	//dont use patches smaller than 16 px. They are unintelligible anyways.
+	if (zoom>0 && tsize>=16*2)
 	{
-		cout<<"network error: ("<<error<<") "<<_reply->errorString().toStdString()<<endl;
-		
-		if(found)
+		int parentx, parenty, offsetx, offsety;
+		QPixmap patch;
+		parentx = x/2;
+		parenty = y/2;
+		offsetx = offx/2 + (x%2)*tileSize/2;
+		offsety = offy/2 + (y%2)*tileSize/2;
+		tileKey tileid(zoom-1,parentx,parenty);
+		tileKey pinned = memCacheKey(zoom-1,parentx,parenty);
+		QHash<tileKey,QPixmap>::const_iterator p = pyramid.constFind(pinned);
+		if (p != pyramid.constEnd())
+		{
+			image = p.value().copy(offsetx,offsety,tsize/2,tsize/2).scaledToHeight(tileSize);
+			return true;
+		}
+		//if the parent is still being decoded keep looking further up
+		if (tileCache.contains(tileid) && loadTile(zoom-1,parentx,parenty,patch))
 		{
-			//if content is not available we dont want to keep requesting it
-			if (error == QNetworkReply::ContentNotFoundError)
+			if (pyramidKeys.contains(pinned))
 			{
-				unavailableTiles.insert(i.key(),1);
+				pyramid.insert(pinned,patch);
 			}
-			//remove the item from queue and try again
-			downloadQueue.remove(i.key());
-			downloading = false;
-			downloadPicture();
+			//render the tile
+			image = patch.copy(offsetx,offsety,tsize/2,tsize/2).scaledToHeight(tileSize);
+			return true;
+		}
+		else
+		{
+			return getTilePatch(zoom-1,parentx,parenty,offsetx,offsety,tsize/2,image);
 		}
 	}
-	_reply->deleteLater();
+	return false;
 }
 /**
-Slot that gets called when theres is an network error
+* Adds a %tile to the HDD cache, the file is written in the background
+* A stale %tile that changed replaces the cached one.
+* @param tileid the %tile
+* @param data encoded image
+* @param lastAccess initial cacheEntry::lastAccess, 0 makes it the first to be evicted
 */
-void cacaMap::slotError(QNetworkReply::NetworkError _code)
+void cacaMap::saveTile(tileKey tileid, QByteArray const & data, quint32 lastAccess)
 {
-	cout<<"some error "<<_code<<endl;
+	if (tileCache.contains(tileid))
+	{
+		cacheSize-=tileCache.value(tileid).size;
+	}
+	cacheSize+=data.size();
+	if (currentPack)
+	{
+		writer.enqueue(currentPack,tileid,data);
+	}
+	else
+	{
+		QString dir = folder+"/"+getTilePath(tileid.zoom(),tileid.x());
+		writer.enqueue(dir,getTileFile(tileid.zoom(),tileid.x(),tileid.y()),data,currentIndex,tileid);
+	}
+	cacheEntry entry(data.size());
+	entry.lastAccess = lastAccess;
+	tileCache.insert(tileid,entry);
+	if (overQuota() && !evictionTimer->isActive())
+	{
+		evictionTimer->start();
+	}
 }
 /**
-Widget resize event handler
+* Checks which parts of a %tile are covered by cached tiles of the next zoom levels
+* @param depth number of levels to look down
+* @param any set to true if at least one of them is cached
+* @return true if they cover the whole %tile
 */
-void cacaMap::resizeEvent(QResizeEvent* event)
+bool cacaMap::childrenCached(int zoom, quint32 x, quint32 y, int depth, bool & any)
 {
-	delete imgBuffer;
-	imgBuffer = new QPixmap(size());
-	updateContent();
+	bool full = true;
+	for (int c=0; c<4; c++)
+	{
+		quint32 cx = 2*x + c%2;
+		quint32 cy = 2*y + c/2;
+		if (tileCache.contains(tileKey(zoom+1,cx,cy)))
+		{
+			any = true;
+		}
+		else if (!(depth > 1 && zoom+1 < maxZoom && childrenCached(zoom+1,cx,cy,depth-1,any)))
+		{
+			full = false;
+		}
+	}
+	return full;
 }
-
 /**
-* Blits buffer to widget
+* Draws the decoded tiles of the next zoom levels that cover a %tile, scaled down
+* Missing ones are requested from the decoder.
+* @param rect where the %tile goes
+* @param depth number of levels to look down
+* @param any set to true if at least one of them was drawn
+* @return true if the whole %tile was covered
 */
-void cacaMap::renderMap(QPainter &p)
+bool cacaMap::drawChildren(QPainter & p, int zoom, quint32 x, quint32 y, QRect const & rect, int depth, bool & any)
 {
-	//QRect dest(QPoint(0,0), size());
-	if (buffzoomrate<1.0)
-	{
-		int ox = width()*(1-buffzoomrate)/2;
-		int oy = height()*(1-buffzoomrate)/2;
-		QRect src(QPoint(ox,oy),size()*buffzoomrate); 
-		
-		tmpbuff= imgBuffer->copy(src).scaled(size(),Qt::KeepAspectRatio);
-
-		p.drawPixmap(0,0,tmpbuff);
-		//p.drawPixmap(dest, *imgBuffer,src);//this is shorter but slower
-	}
-	else
+	bool full = true;
+	int w = rect.width()/2;
+	int h = rect.height()/2;
+	for (int c=0; c<4; c++)
 	{
-		p.drawPixmap(0,0,*imgBuffer);
+		quint32 cx = 2*x + c%2;
+		quint32 cy = 2*y + c/2;
+		QRect quarter(rect.x() + (c%2)*w,rect.y() + (c/2)*h,w,h);
+		QPixmap child;
+		if (tileCache.contains(tileKey(zoom+1,cx,cy)) && loadTile(zoom+1,cx,cy,child))
+		{
+			p.drawPixmap(quarter,child);
+			any = true;
+		}
+		else if (!(depth > 1 && zoom+1 < maxZoom && drawChildren(p,zoom+1,cx,cy,quarter,depth-1,any)))
+		{
+			full = false;
+		}
 	}
+	return full;
 }
 /**
-Paint even handler
+* Keeps a %tile that was put together from its children, so it doesn't have
+* to be downloaded for now. It's encoded in decoderPool and shown as a patch
+* until then, see slotTileEncoded().
 */
-void cacaMap::paintEvent(QPaintEvent *event)
+void cacaMap::saveComposite(int zoom, quint32 x, quint32 y, QPixmap const & image)
 {
-	QPainter p(this);
-	renderMap(p);
+	tileKey tileid(zoom,x,y);
+	tileKey key = memCacheKey(zoom,x,y);
+	patchCache.insert(key,new QPixmap(image),image.width()*image.height()*image.depth()/8);
+	if (!pendingEncodes.contains(key))
+	{
+		pendingEncodes.insert(key);
+		decoderPool.start(new tileEncoder(this,key.id,image.toImage()));
+	}
+	//it may have been queued before the children were available
+	QHash<tileKey,tile>::iterator queued = downloadQueue.find(tileid);
+	if (queued != downloadQueue.end() && !queued.value().reply)
+	{
+		downloadQueue.erase(queued);
+		queueDirty = true;
+	}
 }
-
+/**
+* Slot that gets called (in the GUI thread) when a worker thread finishes encoding a composite %tile
+* It's saved like a downloaded one, but it expires after COMPOSITE_MAX_AGE so
+* the server's own %tile replaces it soon.
+* @see cacaMap::saveComposite
+*/
+void cacaMap::slotTileEncoded(qulonglong id, QByteArray data)
+{
+	tileKey key;
+	key.id = id;
+	pendingEncodes.remove(key);
+	int zoom = key.zoom();
+	quint32 x = key.x();
+	quint32 y = key.y();
+	tileKey tileid(zoom,x,y);
+	//the server might have changed, or the tile arrived meanwhile
+	if (data.isEmpty() || !(key == memCacheKey(zoom,x,y)) || tileCache.contains(tileid))
+	{
+		return;
+	}
+	tileMeta meta;
+	meta.expires = currentTime + COMPOSITE_MAX_AGE;
+	storeMeta(tileid,meta);
+	saveTile(tileid,data,0);
+	QPixmap * pixmap = patchCache.take(key);
+	if (pixmap)
+	{
+		memCache.insert(key,pixmap,pixmap->width()*pixmap->height()*pixmap->depth()/8);
+	}
+}
+/**
+* @return what to show for a visible %tile that isn't available yet. Patches are
+* kept until the %tile arrives, so they are cropped and scaled only once.
+* Cached tiles of the next zoom levels are drawn over the patch, and if they
+* cover it completely the result is kept as the %tile itself.
+*/
+QPixmap cacaMap::getPlaceholder(int zoom, quint32 x, quint32 y)
+{
+	tileKey key = memCacheKey(zoom,x,y);
+	QPixmap * cached = patchCache.object(key);
+	if (cached)
+	{
+		return *cached;
+	}
+	QPixmap patch;
+	bool found = getTilePatch(zoom,x,y,0,0,tileSize,patch);
+	if (!found)
+	{
+		patch = loadingAnim.currentPixmap();
+	}
+	//after zooming out the tiles of the previous levels are usually there
+	bool any = false;
+	if (zoom < maxZoom && !tileCache.contains(tileKey(zoom,x,y)))
+	{
+		childrenCached(zoom,x,y,UNDERZOOM_DEPTH,any);
+	}
+	if (any)
+	{
+		any = false;
+		QPainter p(&patch);
+		p.setRenderHint(QPainter::SmoothPixmapTransform);
+		bool complete = drawChildren(p,zoom,x,y,QRect(0,0,tileSize,tileSize),UNDERZOOM_DEPTH,any);
+		p.end();
+		if (complete)
+		{
+			saveComposite(zoom,x,y,patch);
+			return patch;
+		}
+		found = found || any;
+	}
+	if (found)
+	{
+		patchCache.insert(key,new QPixmap(patch),patch.width()*patch.height()*patch.depth()/8);
+	}
+	return patch;
+}
+/**
+* Pins the decoded ancestors of the visible tiles, so patches never have to
+* read them from HDD again while they are needed
+*/
+void cacaMap::updatePyramid()
+{
+	QSet<tileKey> needed;
+	qint32 numtiles = 1<<tilesToRender.zoom;
+	int depth = qMin(PYRAMID_DEPTH,tilesToRender.zoom);
+	for (qint32 i = tilesToRender.left; i <= tilesToRender.right; i++)
+	{
+		qint32 valx = ((i<0)*numtiles + i%numtiles)%numtiles;
+		for (qint32 j = qMax(0,tilesToRender.top); j <= qMin(numtiles-1,tilesToRender.bottom); j++)
+		{
+			for (int d = 1; d <= depth; d++)
+			{
+				needed.insert(memCacheKey(tilesToRender.zoom-d,valx>>d,j>>d));
+			}
+		}
+	}
+	QHash<tileKey,QPixmap>::iterator p = pyramid.begin();
+	while (p != pyramid.end())
+	{
+		if (needed.contains(p.key()))
+		{
+			++p;
+		}
+		else
+		{
+			p = pyramid.erase(p);
+		}
+	}
+	QSet<tileKey>::const_iterator k;
+	for (k = needed.constBegin(); k != needed.constEnd(); ++k)
+	{
+		if (!pyramid.contains(*k))
+		{
+			QPixmap * cached = memCache.object(*k);
+			if (cached)
+			{
+				pyramid.insert(*k,*cached);
+			}
+		}
+	}
+	pyramidKeys = needed;
+}
+
+
+
+/**
+Starts downloading the next tiles in the queue
+Tiles closest to the center of the view go first, and up to maxDownloads
+requests (fewer if the server's throttle says so) are kept in flight at the
+same time to each host. QNetworkAccessManager keeps the connections to each
+host alive in between. Tiles waiting for a retry or for the rate limit are
+started later by throttleTimer.
+@see cacaMap::downloadQueue
+@see cacaMap::prioritizeDownloads
+*/
+void cacaMap::downloadPicture()
+{
+	if (queueDirty)
+	{
+		sortDownloadQueue();
+	}
+	if (prefetchClock.elapsed() >= 1000)
+	{
+		prefetchClock.restart();
+		prefetchBytes = 0;
+	}
+	metrics.queueDepth.add(downloadQueue.size());
+	qint64 now = netClock.elapsed();
+	int limit = qMin(maxDownloads,currentThrottle->limit());
+	int shards = servermgr.shardCount();
+	int busy = 0;
+	for (int s=0; s<shards; s++)
+	{
+		if (shardDownloads.at(s) >= limit)
+		{
+			busy++;
+		}
+	}
+	//ms until a tile that can't start now can, -1 if there's none
+	qint64 later = -1;
+	int next = 0;
+	while (busy < shards && next < downloadOrder.size())
+	{
+		QHash<tileKey,tile>::iterator i = downloadQueue.find(downloadOrder.at(next));
+		//skip tiles that were dropped or are already being downloaded
+		if (i == downloadQueue.end() || i.value().reply)
+		{
+			downloadOrder.removeAt(next);
+			continue;
+		}
+		//prefetched tiles are sorted last, so once the bandwidth budget is spent nothing else can start
+		if (i.value().prefetch && prefetchBandwidth && prefetchBytes >= (quint64)prefetchBandwidth)
+		{
+			break;
+		}
+		//it failed not long ago
+		if (i.value().notBefore > now)
+		{
+			qint64 wait = i.value().notBefore - now;
+			later = later < 0 ? wait : qMin(later,wait);
+			next++;
+			continue;
+		}
+		int shard = servermgr.tileShard(i.value().x,i.value().y);
+		//its host is busy, the next tiles may go to another one
+		if (shardDownloads.at(shard) >= limit)
+		{
+			next++;
+			continue;
+		}
+		qint64 wait = currentThrottle->wait(now);
+		if (wait)
+		{
+			later = later < 0 ? wait : qMin(later,wait);
+			break;
+		}
+		currentThrottle->take(now);
+		downloadOrder.removeAt(next);
+		QNetworkRequest request;
+		request.setUrl(QUrl(i.value().url));
+		//the server answers 304 without a body if the cached tile is still good
+		if (i.value().revalidate)
+		{
+			tileMeta meta = tileMetas.value(i.key());
+			if (!meta.etag.isEmpty())
+			{
+				request.setRawHeader("If-None-Match",meta.etag);
+			}
+			if (!meta.lastModified.isEmpty())
+			{
+				request.setRawHeader("If-Modified-Since",meta.lastModified);
+			}
+		}
+		QNetworkReply *reply = manager->get(request);
+		connect(reply, SIGNAL(error(QNetworkReply::NetworkError)),this, SLOT(slotError(QNetworkReply::NetworkError)));
+		connect(reply, SIGNAL(downloadProgress(qint64,qint64)),this, SLOT(slotDownloadProgress(qint64, qint64)));
+		i.value().reply = reply;
+		i.value().started = netClock.nsecsElapsed()/1000;
+		i.value().shard = shard;
+		i.value().throttle = currentThrottle;
+		i.value().hedge = 0;
+		activeDownloads.insert(reply,i.value());
+		shardDownloads[shard]++;
+		if (shardDownloads.at(shard) == limit)
+		{
+			busy++;
+		}
+	}
+	//every tile that has to wait was looked at, so this is the earliest any can start
+	if (later >= 0)
+	{
+		throttleTimer->start(later);
+	}
+	if (!activeDownloads.isEmpty() && !timeoutTimer->isActive())
+	{
+		timeoutTimer->start();
+	}
+	if (!activeDownloads.isEmpty() && servermgr.mirrorCount() && !hedgeTimer->isActive())
+	{
+		hedgeTimer->start();
+	}
+}
+
+/**
+* Makes currentThrottle the one of the current server, it's created the first time
+*/
+void cacaMap::selectThrottle()
+{
+	int index = servermgr.serverIndex();
+	if (!throttles.contains(index))
+	{
+		throttles.insert(index,new downloadThrottle(servermgr.maxConnections(),servermgr.connectionsCeiling(),servermgr.rateLimit()));
+	}
+	currentThrottle = throttles.value(index);
+}
+
+/**
+* Rebuilds downloadOrder with the tiles waiting in downloadQueue, sorted by priority
+*/
+void cacaMap::sortDownloadQueue()
+{
+	QVector<QPair<qint64,tileKey> > pending;
+	pending.reserve(downloadQueue.size());
+	QHash<tileKey,tile>::const_iterator i;
+	for (i = downloadQueue.constBegin(); i != downloadQueue.constEnd(); ++i)
+	{
+		if (!i.value().reply)
+		{
+			pending.append(qMakePair(i.value().priority,i.key()));
+		}
+	}
+	qSort(pending);
+	downloadOrder.clear();
+	for (int k=0; k<pending.size(); k++)
+	{
+		downloadOrder.append(pending.at(k).second);
+	}
+	queueDirty = false;
+}
+
+/**
+* computes the offset in px from the center of the view to the center of a %tile
+* in the current zoom level, taking the shortest way around the map horizontally
+*/
+void cacaMap::tileOffset(qint32 x, qint32 y, qint64 & dx, qint64 & dy)
+{
+	qint64 mapsize = ((qint64)1<<zoom)*tileSize;
+	dx = (qint64)x*tileSize + tileSize/2 - viewCenter.x;
+	dy = (qint64)y*tileSize + tileSize/2 - viewCenter.y;
+	//tiles wrap around horizontally
+	if (dx > mapsize/2)
+	{
+		dx -= mapsize;
+	}
+	else if (dx < -mapsize/2)
+	{
+		dx += mapsize;
+	}
+}
+
+/**
+* @return download priority of a %tile in the current zoom level,
+* that is its squared distance in px to the center of the view. Lower goes first.
+* Offsets are saturated at PRIORITY_DISTANCE_MAX so deep zoom levels can't overflow it.
+*/
+qint64 cacaMap::tilePriority(qint32 x, qint32 y)
+{
+	qint64 dx, dy;
+	tileOffset(x,y,dx,dy);
+	dx = qBound(-PRIORITY_DISTANCE_MAX,dx,PRIORITY_DISTANCE_MAX);
+	dy = qBound(-PRIORITY_DISTANCE_MAX,dy,PRIORITY_DISTANCE_MAX);
+	return dx*dx + dy*dy;
+}
+
+/**
+Queues the tiles the view is about to pan over
+It's done once per frame, with the last velocity given, see queuePanPrefetch().
+@param velocity speed of the view center in px/s
+*/
+void cacaMap::prefetchPan(QPointF velocity)
+{
+	prefetchVelocity = velocity;
+	panPending = true;
+	scheduleFrame();
+}
+
+/**
+Replaces the prefetched tiles with the ones ahead of the view, at the velocity given to prefetchPan()
+*/
+void cacaMap::queuePanPrefetch()
+{
+	panPending = false;
+	//dont look further ahead than one screen
+	qreal dx = qBound(-(qreal)width(),prefetchVelocity.x()*PREFETCH_LOOKAHEAD/1000.0,(qreal)width());
+	qreal dy = qBound(-(qreal)height(),prefetchVelocity.y()*PREFETCH_LOOKAHEAD/1000.0,(qreal)height());
+	//too slow to reach new tiles any time soon
+	if (qAbs(dx) < tileSize/4 && qAbs(dy) < tileSize/4)
+	{
+		return;
+	}
+	QPointF from(viewCenter.x,viewCenter.y);
+	queuePrefetch(zoom,from,from+QPointF(dx,dy));
+}
+
+/**
+Queues the tiles around a location at the zoom level the map is heading to
+@param coords longitude and latitude of the future center of the view
+@param level future zoom level
+*/
+void cacaMap::prefetchZoom(QPointF coords, int level)
+{
+	if (level < minZoom || level > maxZoom)
+	{
+		return;
+	}
+	longPoint p = myMercator::geoCoordToPixel(coords,level,tileSize);
+	QPointF center(p.x,p.y);
+	queuePrefetch(level,center,center);
+}
+
+/**
+Replaces the prefetched tiles that haven't started with the ones covering a view
+moving from one center to another, closest to the first one go first.
+@param level zoom level of the tiles
+@param from current center of the view in px
+@param to predicted center of the view in px
+*/
+void cacaMap::queuePrefetch(int level, QPointF const & from, QPointF const & to)
+{
+	//forget the previous prediction, requests in flight are kept
+	int budget = prefetchMax;
+	QHash<tileKey,tile>::iterator i = downloadQueue.begin();
+	while (i != downloadQueue.end())
+	{
+		if (i.value().prefetch && !i.value().reply)
+		{
+			i = downloadQueue.erase(i);
+			continue;
+		}
+		if (i.value().prefetch)
+		{
+			budget--;
+		}
+		++i;
+	}
+	prefetchLevel = level;
+	queueDirty = true;
+	if (budget <= 0)
+	{
+		return;
+	}
+
+	//tiles covered by the view on its way from one center to the other
+	qint64 numtiles = (qint64)1<<level;
+	qreal w = width()/2.0;
+	qreal h = height()/2.0;
+	qint64 left = qFloor((qMin(from.x(),to.x()) - w)/tileSize);
+	qint64 right = qFloor((qMax(from.x(),to.x()) + w)/tileSize);
+	qint64 top = qMax((qint64)0,(qint64)qFloor((qMin(from.y(),to.y()) - h)/tileSize));
+	qint64 bottom = qMin(numtiles-1,(qint64)qFloor((qMax(from.y(),to.y()) + h)/tileSize));
+	//dont visit the same column twice when the map is narrower than the view
+	right = qMin(right,left + numtiles - 1);
+
+	QVector<QPair<qint64,tileKey> > candidates;
+	for (qint64 x = left; x <= right; x++)
+	{
+		qint32 valx = ((x%numtiles) + numtiles)%numtiles;
+		for (qint64 y = top; y <= bottom; y++)
+		{
+			tileKey tileid(level,valx,y);
+			if (tileCache.contains(tileid) || isUnavailable(tileid) || downloadQueue.contains(tileid) || isVisible(tileid))
+			{
+				continue;
+			}
+			qreal dx = qBound((qreal)-PRIORITY_DISTANCE_MAX,(x + 0.5)*tileSize - from.x(),(qreal)PRIORITY_DISTANCE_MAX);
+			qreal dy = qBound((qreal)-PRIORITY_DISTANCE_MAX,(y + 0.5)*tileSize - from.y(),(qreal)PRIORITY_DISTANCE_MAX);
+			candidates.append(qMakePair((qint64)(dx*dx + dy*dy),tileid));
+		}
+	}
+	qSort(candidates);
+	for (int k=0; k<candidates.size() && k<budget; k++)
+	{
+		tileKey tileid = candidates.at(k).second;
+		tile t;
+		t.zoom = level;
+		t.x = tileid.x();
+		t.y = tileid.y();
+		t.url = servermgr.getTileUrl(level,t.x,t.y);
+		t.reply = 0;
+		t.priority = PREFETCH_PRIORITY + candidates.at(k).first;
+		t.prefetch = true;
+		t.revalidate = false;
+		t.retries = 0;
+		t.notBefore = 0;
+		t.hedge = 0;
+		downloadQueue.insert(tileid,t);
+	}
+	downloadPicture();
+}
+
+/**
+* Updates the priority of the queued tiles after the view has moved
+* Tiles that are no longer within the view plus DOWNLOAD_MARGIN tiles (or in another zoom level)
+* are dropped from the queue, and their requests aborted if they had already started.
+*/
+void cacaMap::prioritizeDownloads()
+{
+	qint64 maxdx = width()/2 + (DOWNLOAD_MARGIN+1)*tileSize;
+	qint64 maxdy = height()/2 + (DOWNLOAD_MARGIN+1)*tileSize;
+	QList<QNetworkReply*> stale;
+	QHash<tileKey,tile>::iterator i = downloadQueue.begin();
+	while (i != downloadQueue.end())
+	{
+		tile & t = i.value();
+		bool visible = false;
+		//prefetched tiles are replaced by the next prediction, not by the view
+		if (t.prefetch)
+		{
+			visible = t.reply || t.zoom == prefetchLevel;
+		}
+		else if (t.zoom == zoom)
+		{
+			qint64 dx, dy;
+			tileOffset(t.x,t.y,dx,dy);
+			visible = qAbs(dx) <= maxdx && qAbs(dy) <= maxdy;
+			qint64 distance = tilePriority(t.x,t.y);
+			t.priority = t.revalidate ? REVALIDATE_PRIORITY + distance : distance;
+		}
+		if (visible)
+		{
+			++i;
+		}
+		else
+		{
+			if (t.reply)
+			{
+				stale.append(t.reply);
+			}
+			i = downloadQueue.erase(i);
+		}
+	}
+	queueDirty = true;
+	//abort() emits finished() right away, so it can't be done while iterating the queue
+	for (int k=0; k<stale.size(); k++)
+	{
+		stale.at(k)->abort();
+	}
+}
+/**
+Populates the cache list
+It's read from the server's cache index if it can be trusted, otherwise the existing
+files on the cache folder are checked and the index is rebuilt.
+@see cacheIndex
+*/
+void cacaMap::loadCache()
+{
+	cacheSize=0;
+	unavailableTiles.clear();
+	tileCache.clear();
+	evictionCandidates.clear();
+	QString serverdir = folder+"/cache/"+servermgr.tileCacheFolder();
+	//404s are remembered until they expire
+	currentMeta = metaStores.value(serverdir);
+	if (!currentMeta)
+	{
+		currentMeta = new metaStore(serverdir);
+		metaStores.insert(serverdir,currentMeta);
+	}
+	currentMeta->load(tileMetas,currentTime);
+	QHash<tileKey,tileMeta>::const_iterator m;
+	for (m = tileMetas.constBegin(); m != tileMetas.constEnd(); ++m)
+	{
+		if (m.value().notFound)
+		{
+			unavailableTiles.insert(m.key(),m.value().expires);
+		}
+	}
+	if (servermgr.packedStorage())
+	{
+		currentIndex = 0;
+		currentPack = packs.value(serverdir);
+		if (!currentPack)
+		{
+			currentPack = new packStore(serverdir);
+			packs.insert(serverdir,currentPack);
+		}
+		currentPack->load(tileCache,cacheSize);
+		cout<<"cache size "<<(float)cacheSize/1024/1024<<" MB (packed)"<<endl;
+		return;
+	}
+	currentPack = 0;
+	currentIndex = indexes.value(serverdir);
+	if (!currentIndex)
+	{
+		currentIndex = new cacheIndex(serverdir);
+		indexes.insert(serverdir,currentIndex);
+	}
+	if (currentIndex->load(tileCache,cacheSize))
+	{
+		cout<<"cache size "<<(float)cacheSize/1024/1024<<" MB (from index)"<<endl;
+		return;
+	}
+	currentIndex->scan(tileCache,cacheSize);
+	cout<<"cache size "<<(float)cacheSize/1024/1024<<" MB"<<endl;
+	currentIndex->rebuild(tileCache);
+}
+
+/**
+* Sets the HDD cache quota, tiles are evicted in the background while it's exceeded
+* @param bytes maximum size in bytes, 0 for no limit
+* @param tiles maximum number of tiles, 0 for no limit
+*/
+void cacaMap::setCacheLimit(quint64 bytes, int tiles)
+{
+	cacheLimitBytes = bytes;
+	cacheLimitTiles = tiles;
+	if (overQuota() && !evictionTimer->isActive())
+	{
+		evictionTimer->start();
+	}
+}
+
+/**
+* Sets how the tiles to evict from the HDD cache are chosen
+*/
+void cacaMap::setEvictionPolicy(evictionPolicy _policy)
+{
+	policy = _policy;
+	//the pass in progress was ordered by the old policy
+	evictionCandidates.clear();
+}
+
+/**
+* @return current HDD cache size in bytes
+*/
+quint64 cacaMap::getCacheSize()
+{
+	return cacheSize;
+}
+
+/**
+* @return true if the HDD cache is over any of its limits
+*/
+bool cacaMap::overQuota()
+{
+	return (cacheLimitBytes && cacheSize > cacheLimitBytes)
+		|| (cacheLimitTiles && tileCache.size() > cacheLimitTiles);
+}
+
+/**
+* @return true if the %tile is in the current view
+*/
+bool cacaMap::isVisible(tileKey key)
+{
+	if (key.zoom() != tilesToRender.zoom || (qint32)key.y() < tilesToRender.top || (qint32)key.y() > tilesToRender.bottom)
+	{
+		return false;
+	}
+	//take horizontal wrapping into account
+	qint64 numtiles = (qint64)1<<tilesToRender.zoom;
+	qint64 dx = ((qint64)key.x() - tilesToRender.left) % numtiles;
+	if (dx < 0)
+	{
+		dx += numtiles;
+	}
+	return dx <= tilesToRender.right - tilesToRender.left;
+}
+/**
+* @return true if a cached %tile has to be checked with the server
+*/
+bool cacaMap::isStale(tileKey key)
+{
+	QHash<tileKey,tileMeta>::const_iterator m = tileMetas.constFind(key);
+	if (m == tileMetas.constEnd())
+	{
+		//cached before metadata was kept, give it a lifetime from now on
+		tileMeta meta;
+		meta.expires = currentTime + META_DEFAULT_MAX_AGE;
+		storeMeta(key,meta);
+		return false;
+	}
+	return m.value().expires <= currentTime;
+}
+/**
+* @return true if the server doesn't have the %tile, and it's too soon to ask again
+*/
+bool cacaMap::isUnavailable(tileKey key)
+{
+	QHash<tileKey,quint32>::iterator i = unavailableTiles.find(key);
+	if (i == unavailableTiles.end())
+	{
+		return false;
+	}
+	if (i.value() > currentTime)
+	{
+		return true;
+	}
+	unavailableTiles.erase(i);
+	return false;
+}
+/**
+* Keeps the HTTP caching information of a %tile, in memory and in the server's folder
+* The record is written in the background.
+*/
+void cacaMap::storeMeta(tileKey key, tileMeta const & meta)
+{
+	tileMetas.insert(key,meta);
+	writer.enqueueMeta(currentMeta,key,meta);
+}
+
+/**
+* Removes a %tile from the HDD cache, the file is deleted in the background
+*/
+void cacaMap::evictTile(tileKey key)
+{
+	QHash<tileKey,cacheEntry>::iterator entry = tileCache.find(key);
+	if (entry == tileCache.end())
+	{
+		return;
+	}
+	cacheSize -= entry.value().size;
+	tileCache.erase(entry);
+	memCache.remove(memCacheKey(key.zoom(),key.x(),key.y()));
+	if (tileMetas.remove(key))
+	{
+		writer.enqueueMetaRemove(currentMeta,key);
+	}
+	if (currentPack)
+	{
+		writer.enqueueRemove(currentPack,key);
+	}
+	else
+	{
+		writer.enqueueRemove(getTileFile(key.zoom(),key.x(),key.y()),currentIndex,key);
+	}
+}
+
+/**
+* @return how valuable a cached %tile is for the current eviction policy, lower is evicted first
+*/
+quint64 cacaMap::evictionScore(cacheEntry const & entry)
+{
+	if (policy == LFU)
+	{
+		return ((quint64)entry.hits<<32) | entry.lastAccess;
+	}
+	return ((quint64)entry.lastAccess<<32) | entry.hits;
+}
+
+/**
+* Evicts one batch of the least valuable tiles, until the cache is 10% under its limits
+* The cache is ranked once at the start of an eviction pass, and every batch
+* takes the next tiles from that ranking. Tiles used or shown since the ranking
+* was made are skipped. If the cache is still over quota after the batch
+* another one is scheduled.
+*/
+void cacaMap::slotEvict()
+{
+	if (!overQuota())
+	{
+		evictionCandidates.clear();
+		return;
+	}
+	quint64 targetBytes = cacheLimitBytes/10*9;
+	int targetTiles = cacheLimitTiles/10*9;
+	if (evictionNext >= evictionCandidates.size())
+	{
+		//lower score goes first
+		evictionCandidates.clear();
+		evictionCandidates.reserve(tileCache.size());
+		QHash<tileKey,cacheEntry>::const_iterator i;
+		for (i = tileCache.constBegin(); i != tileCache.constEnd(); ++i)
+		{
+			evictionCandidates.append(qMakePair(evictionScore(i.value()),i.key()));
+		}
+		qSort(evictionCandidates);
+		evictionNext = 0;
+	}
+	int evicted = 0;
+	int end = qMin(evictionNext + EVICT_BATCH,evictionCandidates.size());
+	for (; evictionNext<end; evictionNext++)
+	{
+		if ((!cacheLimitBytes || cacheSize <= targetBytes) && (!cacheLimitTiles || tileCache.size() <= targetTiles))
+		{
+			break;
+		}
+		QPair<quint64,tileKey> const & candidate = evictionCandidates.at(evictionNext);
+		QHash<tileKey,cacheEntry>::const_iterator entry = tileCache.constFind(candidate.second);
+		//already gone, or used since the ranking
+		if (entry == tileCache.constEnd() || evictionScore(entry.value()) != candidate.first || isVisible(candidate.second))
+		{
+			continue;
+		}
+		evictTile(candidate.second);
+		evicted++;
+	}
+	cout<<"evicted "<<evicted<<" tiles, cache size "<<(float)cacheSize/1024/1024<<" MB"<<endl;
+	//a whole ranking without anything to evict means only visible tiles are left
+	if (overQuota() && (evicted || evictionNext < evictionCandidates.size()))
+	{
+		evictionTimer->start();
+	}
+	else
+	{
+		evictionCandidates.clear();
+	}
+}
+
+/**
+Slot to keep track of download progress
+*/
+void cacaMap::slotDownloadProgress(qint64 _bytesReceived, qint64 _bytesTotal)
+{
+}
+
+/**
+* Slot that gets called everytime a %tile download request finishes
+* Saves image file to HDD, takes out item from download queue, and  adds item to cache list
+*/
+void cacaMap::slotDownloadReady(QNetworkReply * _reply)
+{
+	//duplicates sent to mirrors don't take a slot
+	if (hedges.contains(_reply))
+	{
+		hedgeReady(_reply);
+		return;
+	}
+	QNetworkReply::NetworkError error = _reply->error();
+	//find the tile this request was made for
+	tile nextItem = activeDownloads.take(_reply);
+	bool hedged = false;
+	if (nextItem.reply == _reply)
+	{
+		shardDownloads[nextItem.shard]--;
+		hedged = nextItem.hedge && hedges.contains(nextItem.hedge) && hedges.value(nextItem.hedge).original == _reply;
+	}
+	tileKey tileid(nextItem.zoom,nextItem.x,nextItem.y);
+	QHash<tileKey,tile>::iterator i = downloadQueue.find(tileid);
+	bool found = i != downloadQueue.end() && i.value().reply == _reply;
+	if (found)
+	{
+		//remove item from download queue
+		downloadQueue.erase(i);
+	}
+
+	int status = _reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+	qint64 now = netClock.elapsed();
+	qint64 latency = netClock.nsecsElapsed()/1000 - nextItem.started;
+	//requests that took too long are aborted too, but they do say something about the server
+	bool expired = timedOut.remove(_reply);
+	bool aborted = error == QNetworkReply::OperationCanceledError && !expired;
+	serverMetrics * server = 0;
+	if (!aborted)
+	{
+		server = &metrics.servers[servermgr.serverName()];
+		server->requests++;
+		server->latency.add(latency);
+	}
+	//the answer is about the server it was sent to, even if another one is in use now
+	downloadThrottle * throttle = nextItem.reply == _reply ? nextItem.throttle : 0;
+	if (error == QNetworkReply::NoError && throttle)
+	{
+		throttle->success(latency);
+	}
+	if (error == QNetworkReply::NoError && status == 304)
+	{
+		server->notModified++;
+		//the cached tile is still good, only its expiry changes
+		if (nextItem.reply == _reply)
+		{
+			tileMeta meta = metaStore::fromReply(_reply,currentTime);
+			tileMeta old = tileMetas.value(tileid);
+			if (meta.etag.isEmpty())
+			{
+				meta.etag = old.etag;
+			}
+			if (meta.lastModified.isEmpty())
+			{
+				meta.lastModified = old.lastModified;
+			}
+			storeMeta(tileid,meta);
+		}
+	}
+	else if (error == QNetworkReply::NoError)
+	{
+		//get image data
+		QByteArray data = _reply->readAll();
+		server->bytes += data.size();
+		//even if the tile is no longer visible the data is worth keeping
+		if (nextItem.prefetch)
+		{
+			prefetchBytes+=data.size();
+		}
+		if (data.size() && nextItem.reply == _reply)
+		{
+			tileDownloaded(tileid,_reply,data);
+		}
+		else
+		{
+			//cout<<"no data"<<endl;
+		}
+	}
+	else
+	{
+		//aborted requests are not errors
+		if (error == QNetworkReply::ContentNotFoundError)
+		{
+			server->notFound++;
+		}
+		else if (expired)
+		{
+			server->errors++;
+			cout<<"request timed out: "<<nextItem.url.toStdString()<<endl;
+		}
+		else if (!aborted)
+		{
+			server->errors++;
+			cout<<"network error: ("<<error<<") "<<_reply->errorString().toStdString()<<endl;
+		}
+		//the server is overloaded or asking us to slow down
+		bool pushback = expired || status == 429 || status == 503;
+		if (pushback && throttle)
+		{
+			throttle->congestion(now);
+			bool ok;
+			int after = _reply->rawHeader("Retry-After").trimmed().toInt(&ok);
+			if (ok && after > 0)
+			{
+				throttle->pause(now + (qint64)after*1000);
+			}
+		}
+		//worth another try if it wasn't the server saying no (4xx), unless it's not needed anymore
+		bool retry = found && !aborted && (pushback || status >= 500 || !status)
+			&& error != QNetworkReply::ContentNotFoundError && nextItem.retries < RETRY_MAX;
+		if (retry)
+		{
+			nextItem.notBefore = now + nextItem.throttle->backoff(nextItem.retries);
+			nextItem.retries++;
+			//the duplicate on the mirror may still bring it, it's only retried if that fails too
+			if (hedged)
+			{
+				nextItem.reply = nextItem.hedge;
+				hedged = false;
+			}
+			else
+			{
+				nextItem.reply = 0;
+				queueDirty = true;
+			}
+			downloadQueue.insert(tileid,nextItem);
+		}
+		//keep showing a stale tile, but dont check it again for a while
+		else if (nextItem.revalidate && !aborted && nextItem.reply == _reply)
+		{
+			tileMeta meta = tileMetas.value(tileid);
+			meta.expires = currentTime + META_RETRY;
+			storeMeta(tileid,meta);
+		}
+		//if content is not available we dont want to keep requesting it
+		else if (error == QNetworkReply::ContentNotFoundError && nextItem.reply == _reply)
+		{
+			tileMeta meta = metaStore::fromReply(_reply,currentTime);
+			unavailableTiles.insert(tileid,meta.expires);
+			storeMeta(tileid,meta);
+		}
+	}
+	//the answer is settled, the duplicate won't be of use
+	if (hedged)
+	{
+		nextItem.hedge->abort();
+	}
+	_reply->deleteLater();
+	//a slot is free now, start the next download
+	downloadPicture();
+}
+/**
+* Keeps a %tile that was just downloaded: it's saved with its HTTP metadata and decoded
+*/
+void cacaMap::tileDownloaded(tileKey tileid, QNetworkReply * reply, QByteArray const & data)
+{
+	storeMeta(tileid,metaStore::fromReply(reply,currentTime));
+	saveTile(tileid,data,accessTick);
+	//decode it from memory, the tile is redrawn when it's ready
+	tileKey key = memCacheKey(tileid.zoom(),tileid.x(),tileid.y());
+	pendingDecodes.insert(key);
+	decoderPool.start(new tileLoader(this,key.id,data));
+}
+/**
+* Called when a duplicate request sent to a mirror finishes
+* If it brings the %tile before the original request, the original is aborted.
+* If the original failed already the %tile waits for it, and is retried if it fails too.
+* Otherwise it's just dropped, the original request decides what happens to the %tile.
+* @see cacaMap::slotHedge
+*/
+void cacaMap::hedgeReady(QNetworkReply * _reply)
+{
+	hedgeRequest hedge = hedges.take(_reply);
+	QNetworkReply * original = hedge.original;
+	mirrorDownloads[hedge.mirror]--;
+	QHash<QNetworkReply*,tile>::const_iterator active = activeDownloads.constFind(original);
+	QHash<tileKey,tile>::iterator queued = downloadQueue.find(hedge.key);
+	bool waiting = queued != downloadQueue.end() && queued.value().reply == _reply;
+	int status = _reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+	QByteArray data;
+	if (_reply->error() == QNetworkReply::NoError && status != 304 && (waiting || active != activeDownloads.constEnd()))
+	{
+		data = _reply->readAll();
+	}
+	if (data.size())
+	{
+		metrics.hedgeWins++;
+		tileDownloaded(hedge.key,_reply,data);
+		//the original request is settled already, so it's not retried when it's aborted
+		if (queued != downloadQueue.end() && (waiting || queued.value().reply == original))
+		{
+			downloadQueue.erase(queued);
+		}
+		if (active != activeDownloads.constEnd())
+		{
+			//it's at least this slow, leaving it out would make the hedging threshold creep down
+			if (active.value().throttle)
+			{
+				active.value().throttle->abandoned(netClock.nsecsElapsed()/1000 - active.value().started);
+			}
+			original->abort();
+		}
+	}
+	else if (waiting)
+	{
+		//both failed, the %tile is retried once its backoff is over
+		queued.value().reply = 0;
+		queueDirty = true;
+		downloadPicture();
+	}
+	_reply->deleteLater();
+}
+/**
+* Slot that gets called (in the GUI thread) when a worker thread finishes decoding a %tile
+* Adds the image to the in-memory cache and redraws it, together with any patch taken from it.
+* @param readTime us it took to read the file, -1 if it wasn't read
+* @param decodeTime us it took to decode the image
+* @see tileLoader
+*/
+void cacaMap::slotTileDecoded(qulonglong id, QImage image, int readTime, int decodeTime)
+{
+	if (readTime >= 0)
+	{
+		metrics.readTime.add(readTime);
+	}
+	metrics.decodeTime.add(decodeTime);
+	tileKey key;
+	key.id = id;
+	pendingDecodes.remove(key);
+	int zoom = key.zoom();
+	quint32 x = key.x();
+	quint32 y = key.y();
+	//the server might have changed since the tile was requested
+	bool current = key == memCacheKey(zoom,x,y);
+	if (image.isNull())
+	{
+		cout<<"couldn't decode tile "<<zoom<<"/"<<x<<"/"<<y<<endl;
+		if (current)
+		{
+			//the file is missing or broken, download it again
+			evictTile(tileKey(zoom,x,y));
+		}
+		return;
+	}
+	QPixmap * pixmap = new QPixmap(QPixmap::fromImage(image));
+	//cost is the size in bytes of the decoded image
+	//memCache might delete it right away, so pin it first
+	if (pyramidKeys.contains(key))
+	{
+		pyramid.insert(key,*pixmap);
+	}
+	memCache.insert(key, pixmap, pixmap->width()*pixmap->height()*pixmap->depth()/8);
+	//the patch isn't needed anymore, and patches of its descendants can be sharper now
+	patchCache.remove(key);
+	if (current && zoom < tilesToRender.zoom)
+	{
+		patchCache.clear();
+	}
+	//a child of a visible tile makes its placeholder more complete
+	else if (current && zoom - tilesToRender.zoom <= UNDERZOOM_DEPTH)
+	{
+		int up = zoom - tilesToRender.zoom;
+		patchCache.remove(memCacheKey(tilesToRender.zoom,x>>up,y>>up));
+	}
+	//redrawn with whatever else arrives before the next frame
+	if (current)
+	{
+		pendingRedraws.insert(tileKey(zoom,x,y));
+		scheduleFrame();
+	}
+}
+/**
+Slot that gets called when theres is an network error
+*/
+void cacaMap::slotError(QNetworkReply::NetworkError _code)
+{
+	cout<<"some error "<<_code<<endl;
+}
+/**
+Widget resize event handler
+*/
+void cacaMap::resizeEvent(QResizeEvent* event)
+{
+	delete imgBuffer;
+	imgBuffer = new QPixmap(size());
+	bufferDirty = true;
+	updateContent();
+}
+
+/**
+* Blits buffer to widget, magnified if the zoom level has a fraction
+*/
+void cacaMap::renderMap(QPainter &p)
+{
+	qreal fraction = fractionalZoom - zoom;
+	if (fraction <= 0)
+	{
+		p.drawPixmap(0,0,*imgBuffer);
+		return;
+	}
+	//the buffer is magnified around the center of the widget, without copying it
+	qreal scale = pow(2.0,fraction);
+	QPointF center(width()/2.0,height()/2.0);
+	p.save();
+	p.translate(center);
+	p.scale(scale,scale);
+	p.translate(-center);
+	p.drawPixmap(0,0,*imgBuffer);
+	p.restore();
+	if (zoom < maxZoom)
+	{
+		renderLevel(p,zoom+1,scale/2,fraction);
+	}
+	p.drawRect(0,0,width()-1, height()-1);
+}
+/**
+* Draws the decoded tiles of a zoom level straight from memory, scaled around the center of the widget
+* Missing tiles are left out, so what's below shows through.
+* @param level zoom level of the tiles
+* @param scale size on screen of a %tile px
+* @param opacity used to fade the level in
+*/
+void cacaMap::renderLevel(QPainter &p, int level, qreal scale, qreal opacity)
+{
+	longPoint center = myMercator::geoCoordToPixel(geocoords,level,tileSize);
+	qint64 numtiles = (qint64)1<<level;
+	qreal halfw = width()/2.0/scale;
+	qreal halfh = height()/2.0/scale;
+	qint64 left = qFloor((center.x - halfw)/tileSize);
+	qint64 right = qFloor((center.x + halfw)/tileSize);
+	qint64 top = qMax((qint64)0,(qint64)qFloor((center.y - halfh)/tileSize));
+	qint64 bottom = qMin(numtiles-1,(qint64)qFloor((center.y + halfh)/tileSize));
+	p.save();
+	p.setOpacity(opacity);
+	p.translate(width()/2.0,height()/2.0);
+	p.scale(scale,scale);
+	for (qint64 i = left; i <= right; i++)
+	{
+		quint32 valx = ((i%numtiles) + numtiles)%numtiles;
+		for (qint64 j = top; j <= bottom; j++)
+		{
+			QPixmap * image = memCache.object(memCacheKey(level,valx,j));
+			if (image)
+			{
+				p.drawPixmap(QPointF((qreal)(i*tileSize) - center.x,(qreal)(j*tileSize) - center.y),*image);
+			}
+		}
+	}
+	p.restore();
+}
+/**
+Paint even handler
+*/
+void cacaMap::paintEvent(QPaintEvent *event)
+{
+	//never show a buffer that is behind
+	if (contentDirty || !pendingRedraws.isEmpty())
+	{
+		frameTimer->stop();
+		flushUpdates();
+	}
+	QPainter p(this);
+	renderMap(p);
+	metrics.frames++;
+	if (!placeholderTiles.isEmpty())
+	{
+		metrics.placeholderFrames++;
+	}
+}
+
 /**
 destructor
 */
 cacaMap::~cacaMap()
 {
+	//decoded tiles can't be delivered once we are gone
+	decoderPool.waitForDone();
+	//flush tiles that haven't been saved yet
+	writer.stop();
+	writer.wait();
+	//nothing else is written to the cache folders, so the indexes can be closed
+	qDeleteAll(indexes);
+	qDeleteAll(packs);
+	qDeleteAll(metaStores);
+	qDeleteAll(throttles);
 	delete manager;
 	delete imgBuffer;
 }
@@ -568,91 +1811,461 @@ void cacaMap::updateTilesToRender()
 	tilesToRender.offsetx = globaloffsetx;
 	tilesToRender.offsety = globaloffsety;
 	tilesToRender.zoom = zoom;
+
+	viewCenter = pixelCoords;
+	//placeholders that scrolled out of view aren't shown anymore
+	QSet<tileKey>::iterator k = placeholderTiles.begin();
+	while (k != placeholderTiles.end())
+	{
+		if (isVisible(*k))
+		{
+			++k;
+		}
+		else
+		{
+			k = placeholderTiles.erase(k);
+		}
+	}
+	prioritizeDownloads();
+	updatePyramid();
+}
+/**
+* Draws a single visible %tile into the buffer
+* Queues the %tile for download (and draws a patch) if it's not cached.
+* @param p painter open on the image buffer
+* @param i %tile column, it can be outside [0,2^zoom] (horizontal wrapping)
+* @param j %tile row
+*/
+void cacaMap::drawTile(QPainter &p, qint32 i, qint32 j)
+{
+	//wrap around the tiles horizontally if i is outside [0,2^zoom]
+	qint32 numtiles = 1<<tilesToRender.zoom;
+	qint32 valx =((i<0)*numtiles + i%numtiles)%numtiles;
+	QPixmap image;
+	int posx = (i-tilesToRender.left)*tileSize - tilesToRender.offsetx;
+	int posy =  (j-tilesToRender.top)*tileSize - tilesToRender.offsety;
+	//dont try to render tiles with y coords outside range
+	//cause we cant do vertical wrapping!
+	if (j>=0 && j<numtiles)
+	{
+		tileKey tileid(tilesToRender.zoom,valx,j);
+		bool placeholder = false;
+		if (tileCache.contains(tileid))
+		{
+			metrics.diskHits++;
+			//render the tile, or a patch until it's decoded
+			if (!loadTile(tilesToRender.zoom,valx,j,image))
+			{
+				image = getPlaceholder(tilesToRender.zoom,valx,j);
+				placeholder = true;
+			}
+			//it's shown anyway, but checked in the background in case it changed
+			if (isStale(tileid) && !downloadQueue.contains(tileid))
+			{
+				tile t;
+				t.zoom = tilesToRender.zoom;
+				t.x = valx;
+				t.y = j;
+				t.url = servermgr.getTileUrl(tilesToRender.zoom,valx,j);
+				t.reply = 0;
+				t.priority = REVALIDATE_PRIORITY + tilePriority(valx,j);
+				t.prefetch = false;
+				t.revalidate = true;
+				t.retries = 0;
+				t.notBefore = 0;
+				t.hedge = 0;
+				downloadQueue.insert(tileid,t);
+				queueDirty = true;
+			}
+		}
+		//check if it's in the list of unavailable tiles
+		else if (isUnavailable(tileid))
+		{
+			image = notAvailableTile;
+		}
+		//the tile is not cached so download it
+		else
+		{
+			metrics.diskMisses++;
+			//tiles covered by their children are put together instead, see getPlaceholder()
+			bool anyChild = false;
+			bool covered = tilesToRender.zoom < maxZoom && childrenCached(tilesToRender.zoom,valx,j,UNDERZOOM_DEPTH,anyChild);
+			//check that the image hasnt been queued already
+			QHash<tileKey,tile>::iterator queued = downloadQueue.find(tileid);
+			if (queued != downloadQueue.end())
+			{
+				//it was prefetched and now it's needed
+				if (queued.value().prefetch)
+				{
+					queued.value().prefetch = false;
+					queued.value().priority = tilePriority(valx,j);
+					queueDirty = true;
+				}
+			}
+			else if (!covered)
+			{
+				tile t;
+				t.zoom = tilesToRender.zoom;
+				t.x = valx;
+				t.y = j;
+				t.url = servermgr.getTileUrl(tilesToRender.zoom,valx,j);
+				t.reply = 0;
+				t.priority = tilePriority(valx,j);
+				t.prefetch = false;
+				t.revalidate = false;
+				t.retries = 0;
+				t.notBefore = 0;
+				t.hedge = 0;
+				//queue the image for download
+				downloadQueue.insert(tileid,t);
+				queueDirty = true;
+			}
+			//crop a tile from a lower zoom level and use it as a patch(a la google maps)
+			//while the tile is downloading	
+			image = getPlaceholder(tilesToRender.zoom,valx,j);
+			placeholder = true;
+		}
+		if (placeholder)
+		{
+			placeholderTiles.insert(tileid);
+		}
+		else
+		{
+			placeholderTiles.remove(tileid);
+		}
+		QElapsedTimer blit;
+		blit.start();
+		p.drawPixmap(posx,posy,image);
+		metrics.blitTime.add(blit.nsecsElapsed()/1000);
+	}
+}
+
+/**
+* Redraws every visible copy of a %tile (there can be more than one due to wrapping)
+* Used to replace a patch once the real %tile is available. If the %tile is from
+* a lower zoom level all the visible tiles covered by it are redrawn, since they
+* might be using it as a patch.
+*/
+void cacaMap::redrawTile(int zoom, quint32 x, quint32 y)
+{
+	if (bufferDirty)
+	{
+		return;
+	}
+	//it may be part of the placeholder of a visible tile
+	if (zoom > tilesToRender.zoom)
+	{
+		int up = zoom - tilesToRender.zoom;
+		if (up > UNDERZOOM_DEPTH)
+		{
+			return;
+		}
+		zoom = tilesToRender.zoom;
+		x >>= up;
+		y >>= up;
+	}
+	int dz = tilesToRender.zoom - zoom;
+	//range of tiles in the current zoom level covered by this one
+	qint32 firstx = x<<dz;
+	qint32 lastx = ((x+1)<<dz) - 1;
+	qint32 firsty = qMax((qint32)(y<<dz),tilesToRender.top);
+	qint32 lasty = qMin((qint32)(((y+1)<<dz) - 1),tilesToRender.bottom);
+	if (firsty > lasty)
+	{
+		return;
+	}
+	qint32 numtiles = 1<<tilesToRender.zoom;
+	QPainter p(imgBuffer);
+	for (qint32 i= tilesToRender.left;i<= tilesToRender.right; i++)
+	{
+		qint32 valx =((i<0)*numtiles + i%numtiles)%numtiles;
+		if (valx >= firstx && valx <= lastx)
+		{
+			for (qint32 j=firsty; j<= lasty; j++)
+			{
+				drawTile(p,i,j);
+			}
+		}
+	}
+	p.drawRect(0,0,width()-1, height()-1);
 }
+
 /**
 * Blits visible tiles buffer
+* This is a full redraw, only needed after a zoom, resize or server change.
+* @see cacaMap::scrollBuffer
 */
 void cacaMap::updateBuffer()
 {
+	QElapsedTimer clock;
+	clock.start();
+	//every visible tile is drawn again
+	placeholderTiles.clear();
 	QPainter p(imgBuffer);
 	imgBuffer->fill(Qt::gray);
 	for (qint32 i= tilesToRender.left;i<= tilesToRender.right; i++)
 	{
 		for (qint32 j=tilesToRender.top ; j<= tilesToRender.bottom; j++)
 		{
-			QString x;
-			QString y;
-			//wrap around the tiles horizontally if i is outside [0,2^zoom]
-			qint32 numtiles = 1<<tilesToRender.zoom;
-			qint32 valx =((i<0)*numtiles + i%numtiles)%numtiles;
-			x.setNum(valx);
-			QPixmap image;
-			int posx = (i-tilesToRender.left)*tileSize - tilesToRender.offsetx;
-			int posy =  (j-tilesToRender.top)*tileSize - tilesToRender.offsety;
-			//dont try to render tiles with y coords outside range
-			//cause we cant do vertical wrapping!
-			if (j>=0 && j<numtiles)
+			drawTile(p,i,j);
+		}
+	}
+	p.drawRect(0,0,width()-1, height()-1);
+	bufferDirty = false;
+	pendingRedraws.clear();
+	downloadPicture();
+	metrics.bufferTime.add(clock.nsecsElapsed()/1000);
+}
+
+/**
+* Shifts the buffer contents by the pan delta and only draws the newly exposed strips
+* Falls back to a full redraw if the zoom level changed or nothing can be reused.
+* @param old range of tiles the buffer was drawn with
+*/
+void cacaMap::scrollBuffer(tileSet const & old)
+{
+	//pixel position (in the whole map) of the buffer's top left corner
+	qint64 dx = ((qint64)old.left*tileSize + old.offsetx) - ((qint64)tilesToRender.left*tileSize + tilesToRender.offsetx);
+	qint64 dy = ((qint64)old.top*tileSize + old.offsety) - ((qint64)tilesToRender.top*tileSize + tilesToRender.offsety);
+
+	if (old.zoom != tilesToRender.zoom || qAbs(dx) >= width() || qAbs(dy) >= height())
+	{
+		updateBuffer();
+		return;
+	}
+	QElapsedTimer clock;
+	clock.start();
+	if (dx || dy)
+	{
+		QRect all = imgBuffer->rect();
+		//the 1px border is not map content, so it's not reused
+		QRect reused = all.adjusted(1,1,-1,-1).translated((int)dx,(int)dy);
+		imgBuffer->scroll((int)dx,(int)dy,all);
+		QRegion exposed = QRegion(all).subtracted(QRegion(reused));
+
+		QPainter p(imgBuffer);
+		p.setClipRegion(exposed);
+		p.fillRect(all,Qt::gray);
+		for (qint32 i= tilesToRender.left;i<= tilesToRender.right; i++)
+		{
+			for (qint32 j=tilesToRender.top ; j<= tilesToRender.bottom; j++)
 			{
-				QString tileid = QString().setNum(tilesToRender.zoom) +"."+x+"."+QString().setNum(j);
-				if (tileCache.contains(tileid))
-				{
-					//render the tile
-					QDir::setCurrent(folder);
-					//check path format (windows?)
-					QString path= getTilePath(tilesToRender.zoom,valx) ;
-					QString fileName = servermgr.fileName(j);
-					QDir::setCurrent(path);
-					QFile f(fileName);
-					if (f.open(QIODevice::ReadOnly))
-					{
-						image.loadFromData(f.readAll());
-						f.close();
-					}
-					else
-					{
-						cout<<"no file found "<<path.toStdString()<<fileName.toStdString()<<endl;
-					}
-				}
-				//check if it's in the list of unavailable tiles
-				else if (unavailableTiles.contains(tileid))
-				{
-					image = notAvailableTile;
-				}
-				//the tile is not cached so download it
-				else
+				int posx = (i-tilesToRender.left)*tileSize - tilesToRender.offsetx;
+				int posy =  (j-tilesToRender.top)*tileSize - tilesToRender.offsety;
+				if (exposed.intersects(QRect(posx,posy,tileSize,tileSize)))
 				{
-					//check that the image hasnt been queued already
-					if (!downloadQueue.contains(tileid))
-					{
-						tile t;
-						t.zoom = tilesToRender.zoom;
-						t.x = valx;
-						t.y = j;
-						t.url = servermgr.getTileUrl(tilesToRender.zoom,valx,j);
-						//queue the image for download
-						downloadQueue.insert(tileid,t);
-					}
-					//crop a tile from a lower zoom level and use it as a patch(a la google maps)
-					//while the tile is downloading	
-					image = getTilePatch(tilesToRender.zoom,valx,j,0,0,tileSize);
+					drawTile(p,i,j);
 				}
-				p.drawPixmap(posx,posy,image);
 			}
 		}
+		p.setClipping(false);
+		p.drawRect(0,0,width()-1, height()-1);
 	}
-	p.drawRect(0,0,width()-1, height()-1);
-	if (!downloading)
+	downloadPicture();
+	metrics.scrollTime.add(clock.nsecsElapsed()/1000);
+}
+/**
+* Marks the view as changed (pan, zoom, server...), the buffer is updated
+* once in the next frame no matter how many changes happen until then
+*/
+void cacaMap::scheduleUpdate()
+{
+	contentDirty = true;
+	scheduleFrame();
+}
+/**
+* Makes sure a frame is coming, at most one every FRAME_INTERVAL ms
+*/
+void cacaMap::scheduleFrame()
+{
+	if (!frameTimer->isActive())
 	{
-		downloadPicture();
+		frameTimer->start();
+	}
+}
+/**
+* Applies all the changes since the last frame to the buffer
+*/
+void cacaMap::flushUpdates()
+{
+	if (contentDirty)
+	{
+		contentDirty = false;
+		updateContent();
+	}
+	//after updateContent(), so it starts from where the view is now
+	if (panPending)
+	{
+		queuePanPrefetch();
+	}
+	QSet<tileKey> arrived = pendingRedraws;
+	pendingRedraws.clear();
+	QSet<tileKey>::const_iterator i;
+	for (i = arrived.constBegin(); i != arrived.constEnd(); ++i)
+	{
+		redrawTile((*i).zoom(),(*i).x(),(*i).y());
 	}
 }
 /**
+* Emits metricsUpdated(), and writes the metrics to metricsFile if there is one
+* The file is replaced atomically so it can be read at any time.
+*/
+void cacaMap::slotMetrics()
+{
+	if (!metricsFile.isEmpty())
+	{
+		QString tmppath = metricsFile+".tmp";
+		QFile f(tmppath);
+		if (f.open(QIODevice::WriteOnly))
+		{
+			f.write(metrics.toJson().toUtf8());
+			f.write("\n");
+			f.close();
+			if (std::rename(QFile::encodeName(tmppath).constData(),QFile::encodeName(metricsFile).constData()) != 0)
+			{
+				//windows doesn't replace existing files
+				QFile::remove(metricsFile);
+				QFile::rename(tmppath,metricsFile);
+			}
+		}
+		else
+		{
+			cout<<"couldn't write metrics to "<<tmppath.toStdString()<<endl;
+		}
+	}
+	emit metricsUpdated();
+}
+/**
+* Starts the downloads that were waiting for a retry or for the rate limit
+*/
+void cacaMap::slotRetry()
+{
+	downloadPicture();
+}
+/**
+* Aborts the requests that have been in flight for longer than REQUEST_TIMEOUT
+* They count as the server pushing back, and are retried.
+*/
+void cacaMap::slotTimeouts()
+{
+	if (activeDownloads.isEmpty() && hedges.isEmpty())
+	{
+		timeoutTimer->stop();
+		return;
+	}
+	qint64 now = netClock.nsecsElapsed()/1000;
+	QList<QNetworkReply*> expired;
+	QHash<QNetworkReply*,tile>::const_iterator i;
+	for (i = activeDownloads.constBegin(); i != activeDownloads.constEnd(); ++i)
+	{
+		if (now - i.value().started > (qint64)REQUEST_TIMEOUT*1000)
+		{
+			expired.append(i.key());
+		}
+	}
+	//duplicates that take too long just lose the race
+	QList<QNetworkReply*> expiredHedges;
+	QHash<QNetworkReply*,hedgeRequest>::const_iterator h;
+	for (h = hedges.constBegin(); h != hedges.constEnd(); ++h)
+	{
+		if (now - h.value().started > (qint64)REQUEST_TIMEOUT*1000)
+		{
+			expiredHedges.append(h.key());
+		}
+	}
+	//abort() emits finished() right away, so it can't be done while iterating activeDownloads
+	for (int k=0; k<expired.size(); k++)
+	{
+		timedOut.insert(expired.at(k));
+		expired.at(k)->abort();
+	}
+	for (int k=0; k<expiredHedges.size(); k++)
+	{
+		//it may have been aborted together with its original already
+		if (hedges.contains(expiredHedges.at(k)))
+		{
+			expiredHedges.at(k)->abort();
+		}
+	}
+}
+/**
+* Sends a duplicate to a mirror of the visible tiles' requests that are taking unusually long
+* That's longer than HEDGE_PERCENTILE of the recent answers, within the throttle's
+* budget and the per-host limit of the mirror. The first good answer is used, see hedgeReady().
+*/
+void cacaMap::slotHedge()
+{
+	if (activeDownloads.isEmpty() || !servermgr.mirrorCount())
+	{
+		hedgeTimer->stop();
+		return;
+	}
+	qint64 delay = currentThrottle->hedgeDelay();
+	if (delay < 0)
+	{
+		return;
+	}
+	qint64 now = netClock.nsecsElapsed()/1000;
+	int limit = qMin(maxDownloads,currentThrottle->limit());
+	QHash<QNetworkReply*,tile>::iterator i;
+	for (i = activeDownloads.begin(); i != activeDownloads.end(); ++i)
+	{
+		tile & t = i.value();
+		//only holes in the view are worth the extra traffic
+		if (t.hedge || t.prefetch || t.revalidate || t.throttle != currentThrottle || now - t.started < delay || !isVisible(tileKey(t.zoom,t.x,t.y)))
+		{
+			continue;
+		}
+		//its mirror is busy, the next tiles may go to another one
+		int mirror = servermgr.tileMirror(t.x,t.y);
+		if (mirrorDownloads.at(mirror) >= limit)
+		{
+			continue;
+		}
+		if (!currentThrottle->takeHedge())
+		{
+			break;
+		}
+		QNetworkRequest request;
+		request.setUrl(QUrl(servermgr.getMirrorUrl(t.zoom,t.x,t.y)));
+		t.hedge = manager->get(request);
+		hedgeRequest hedge;
+		hedge.original = i.key();
+		hedge.key = tileKey(t.zoom,t.x,t.y);
+		hedge.mirror = mirror;
+		hedge.started = now;
+		hedges.insert(t.hedge,hedge);
+		mirrorDownloads[mirror]++;
+		metrics.hedges++;
+	}
+}
+/**
+* Draws a frame with the pending changes
+*/
+void cacaMap::slotFrame()
+{
+	flushUpdates();
+	update();
+}
+/**
 * calls the following two functions
+* The buffer is only fully redrawn if bufferDirty is set, otherwise it's scrolled
 * @see cacaMap::updateTilesToRender
 * @see cacaMap::updateBuffer
+* @see cacaMap::scrollBuffer
 */
 void cacaMap::updateContent()
 {
+	accessTick++;
+	currentTime = metaStore::now();
+	tileSet old = tilesToRender;
 	updateTilesToRender();
-	updateBuffer();
+	if (bufferDirty)
+	{
+		updateBuffer();
+	}
+	else
+	{
+		scrollBuffer(old);
+	}
 }
@@ -20,31 +20,23 @@ GNU General Public License for more details.
 #ifndef CACAMAP_H
 #define CACAMAP_H
 #include <QtGui>
+#if QT_VERSION >= 0x050000
+#include <QtWidgets>
+#endif
 #include <QtNetwork>
 #include <iostream>
 #include <vector>
 #include "servermanager.h"
+#include "mercator.h"
+#include "tilekey.h"
+#include "tileloader.h"
+#include "tilewriter.h"
+#include "cacheindex.h"
+#include "packstore.h"
+#include "metastore.h"
+#include "mapmetrics.h"
+#include "throttle.h"
 
-/**
-* The quint32 version of QPoint
-*/
-
-struct longPoint
-{
-	quint32 x;/**< x coord. */
-	quint32 y;/**< y coord.*/
-	longPoint(quint32,quint32);
-	longPoint();
-};
-
-/**
-Helper struct that handles coordinate transformations
-*/
-struct myMercator
-{
-	static longPoint geoCoordToPixel(QPointF const &,int , int);
-	static QPointF pixelToGeoCoord(longPoint const &, int, int);
-};
 /**
 * Struct to define a range of consecutive tiles
 * It's used to identify which tiles are visible and need to be rendered/downlaoded
@@ -70,12 +62,124 @@ struct tile
 	int zoom;/**< zoom level.*/
 	qint32 x;/**< colum number.*/
 	qint32 y;/**< row number.*/
-	QString  url;/**<used to identify the %tile when it finishes downloading.*/
+	QString  url;/**< url the %tile is downloaded from.*/
+	QNetworkReply * reply;/**< request in flight for this %tile, 0 if it hasn't started yet.*/
+	qint64 priority;/**< squared distance in px to the center of the view, lower is downloaded first.*/
+	bool prefetch;/**< queued ahead of the view rather than because it's visible.*/
+	bool revalidate;/**< cached already but stale, it's requested conditionally in case it changed.*/
+	qint64 started;/**< us on cacaMap::netClock when the request was sent.*/
+	int shard;/**< host the request was sent to, see servermanager::tileShard().*/
+	downloadThrottle * throttle;/**< limits of the server the request was sent to, which may not be the current one anymore.*/
+	int retries;/**< number of times the request failed and was queued again.*/
+	qint64 notBefore;/**< ms on cacaMap::netClock before which it can't be retried.*/
+	QNetworkReply * hedge;/**< duplicate request sent to a mirror, 0 if there's none.*/
+};
+/**
+* A duplicate request sent to a mirror
+* @see cacaMap::slotHedge
+*/
+struct hedgeRequest
+{
+	QNetworkReply * original;/**< the slow request it duplicates.*/
+	tileKey key;/**< the %tile.*/
+	int mirror;/**< mirror it was sent to, see servermanager::tileMirror().*/
+	qint64 started;/**< us on cacaMap::netClock when it was sent.*/
 };
 /**
-* maximum space allowed for caching tiles
+* default space allowed for caching tiles in HDD
+* @see cacaMap::setCacheLimit()
+*/
+#define CACHE_MAX_DEFAULT 512*1024*1024 //512MB
+/**
+* maximum number of tiles evicted from the HDD cache in one go
+*/
+#define EVICT_BATCH 1000
+/**
+* ms between eviction batches
+*/
+#define EVICT_INTERVAL 1000
+/**
+* number of tiles beyond the edges of the view that are still worth downloading
+* queued tiles further away than this are dropped and their requests aborted
 */
-#define CACHE_MAX 1*1024*1024 //1MB
+#define DOWNLOAD_MARGIN 2
+/**
+* ms ahead that pan prefetching tries to predict
+* @see cacaMap::prefetchPan()
+*/
+#define PREFETCH_LOOKAHEAD 500
+/**
+* default maximum number of prefetched tiles queued or downloading
+* @see cacaMap::setPrefetchBudget()
+*/
+#define PREFETCH_TILES_DEFAULT 32
+/**
+* default bandwidth allowed for prefetching in bytes/s
+* @see cacaMap::setPrefetchBudget()
+*/
+#define PREFETCH_BANDWIDTH_DEFAULT 256*1024 //256KB/s
+/**
+* px from the center of the view beyond which tiles are equally far for their priority
+* it keeps the squared distance under 2^57, so the offsets below can be added to it
+*/
+#define PRIORITY_DISTANCE_MAX ((qint64)1<<28)
+/**
+* added to the priority of prefetched tiles so they are downloaded after every visible one
+*/
+#define PREFETCH_PRIORITY ((qint64)1<<60)
+/**
+* added to the priority of stale tiles so missing ones are downloaded first
+*/
+#define REVALIDATE_PRIORITY ((qint64)1<<59)
+/**
+* ms between frames, pan/zoom changes and arriving tiles are applied at most this often
+* @see cacaMap::scheduleUpdate()
+*/
+#define FRAME_INTERVAL 16
+/**
+* default memory budget for decoded tiles kept in RAM
+* @see cacaMap::memCache
+*/
+#define MEMCACHE_MAX 32*1024*1024 //32MB
+/**
+* number of zoom levels above the view whose decoded tiles are kept pinned for patches
+* a patch from further up would be smaller than 16px
+* @see cacaMap::getTilePatch()
+*/
+#define PYRAMID_DEPTH 4
+/**
+* memory budget for placeholder patches of tiles that haven't arrived yet
+* @see cacaMap::patchCache
+*/
+#define PATCHCACHE_MAX 16*1024*1024 //16MB
+/**
+* number of zoom levels below a missing %tile whose cached tiles are used to put it together
+* @see cacaMap::getPlaceholder()
+*/
+#define UNDERZOOM_DEPTH 2
+/**
+* seconds a %tile put together from its children is kept before the server's own is fetched
+* @see cacaMap::saveComposite()
+*/
+#define COMPOSITE_MAX_AGE 300
+/**
+* ms a request may take before it's aborted and retried
+*/
+#define REQUEST_TIMEOUT 30000
+/**
+* ms between checks for requests that took too long
+*/
+#define TIMEOUT_CHECK_INTERVAL 1000
+/**
+* ms between checks for requests slow enough to be hedged
+* @see cacaMap::slotHedge()
+*/
+#define HEDGE_CHECK_INTERVAL 50
+/**
+* default ms between metricsUpdated() signals, 0 disables them
+* @see cacaMap::setMetricsInterval()
+*/
+#define METRICS_INTERVAL_DEFAULT 0
 /**
 Main map widget
 */
@@ -87,6 +191,15 @@ class cacaMap : public QWidget
 Q_OBJECT
 
 public:	
+	/**
+	* How the tiles to evict from the HDD cache are chosen
+	*/
+	enum evictionPolicy
+	{
+		LRU,/**< least recently used first. */
+		LFU/**< least frequently used first, ties broken by age. */
+	};
+
 	cacaMap(QWidget * _parent=0);
 
 	virtual ~cacaMap();
@@ -94,28 +207,127 @@ public:
 	bool zoomIn();
 	bool zoomOut();
 	bool setZoom(int level);
+	bool setZoom(double level);
 	QPointF getGeoCoords();
 	QStringList getServerNames();
 	void setServer(int);
 	int getZoom();
+	double getFractionalZoom();
+	void setMaxDownloads(int);
+	void setMemCacheSize(int);
+	void setCacheLimit(quint64, int tiles=0);
+	void setEvictionPolicy(evictionPolicy);
+	quint64 getCacheSize();
+	quint64 getMemCacheHits();
+	quint64 getMemCacheMisses();
+	void setPrefetchBudget(int, int);
+	mapMetrics const & getMetrics();
+	QString getMetricsJson();
+	void resetMetrics();
+	void setMetricsInterval(int, QString const & dumpFile=QString());
+
+signals:
+	void metricsUpdated();
+	void serverChanged();
 
 private:
+	friend class mapBench;/**< bench/mapbench.cpp measures the internals directly. */
+	friend class loadTest;/**< loadtest/loadtest.cpp watches the download queue and the caches. */
 	QNetworkAccessManager *manager;/**< manages http requests. */
 	tileSet tilesToRender;/**< range of visible tiles. */
-	QHash<QString,int> tileCache;/**< list of cached tiles (in HDD). */
-	QHash<QString,tile> downloadQueue;/**< list of tiles waiting to be downloaded. */
-	QHash<QString,int> unavailableTiles;/**< list of tiles that were not found on the server.*/
-	bool downloading;/**< flag that indicates if there is a download going on. */
+	QHash<tileKey,cacheEntry> tileCache;/**< list of cached tiles (in HDD), their size and usage. */
+	quint64 cacheLimitBytes;/**< HDD cache quota in bytes, 0 for no limit. */
+	int cacheLimitTiles;/**< HDD cache quota in number of tiles, 0 for no limit. */
+	evictionPolicy policy;/**< how tiles to evict are chosen. */
+	quint32 accessTick;/**< logical clock for cacheEntry::lastAccess, ticks once per map update. */
+	QTimer * evictionTimer;/**< runs the next eviction batch. */
+	QVector<QPair<quint64,tileKey> > evictionCandidates;/**< tiles of the current eviction pass with their score, least valuable first. */
+	int evictionNext;/**< position in evictionCandidates where the next batch starts. */
+	QHash<QString,cacheIndex*> indexes;/**< persistent cache index of each server folder used so far. */
+	cacheIndex * currentIndex;/**< index of the current server's folder, 0 if it uses pack storage. */
+	QHash<QString,packStore*> packs;/**< pack stores of the servers with pack storage used so far. */
+	packStore * currentPack;/**< pack store of the current server, 0 if it uses one file per %tile. */
+	QHash<tileKey,tile> downloadQueue;/**< list of tiles waiting to be downloaded or downloading. */
+	QList<tileKey> downloadOrder;/**< tiles in downloadQueue that haven't started, sorted by priority. */
+	bool queueDirty;/**< downloadOrder needs to be sorted again. */
+	longPoint viewCenter;/**< px coords of the center of the view, used to prioritize downloads. */
+	QHash<tileKey,quint32> unavailableTiles;/**< list of tiles that were not found on the server, and when to ask again.*/
+	QHash<tileKey,tileMeta> tileMetas;/**< HTTP caching information of the tiles of the current server. */
+	QHash<QString,metaStore*> metaStores;/**< persistent tileMetas of each server folder used so far. */
+	metaStore * currentMeta;/**< metadata of the current server's tiles. */
+	quint32 currentTime;/**< time_t, refreshed on every map update. */
+	QCache<tileKey,QPixmap> memCache;/**< LRU of decoded tiles (in RAM), cost is in bytes. */
+	QHash<tileKey,QPixmap> pyramid;/**< decoded ancestors of the visible tiles, not subject to memCache eviction. */
+	QSet<tileKey> pyramidKeys;/**< ancestors of the visible tiles, pinned as soon as they are decoded. */
+	QTimer * frameTimer;/**< fires the next frame. */
+	bool contentDirty;/**< the view changed since the last frame. */
+	QPointF prefetchVelocity;/**< px/s of the view when the pan prefetch is next updated, see prefetchPan(). */
+	bool panPending;/**< the pan prefetch is updated at the next frame. */
+	QSet<tileKey> pendingRedraws;/**< tiles that were decoded since the last frame. */
+	QSet<tileKey> placeholderTiles;/**< visible tiles drawn with a placeholder so far. */
+	mapMetrics metrics;/**< where the time goes, always on. */
+	QElapsedTimer netClock;/**< time base of tile::started. */
+	QTimer * metricsTimer;/**< emits metricsUpdated() periodically. */
+	QString metricsFile;/**< file the metrics are written to as json on every metricsTimer tick, if not empty. */
+	QCache<tileKey,QPixmap> patchCache;/**< placeholders of visible tiles that aren't available yet, cost is in bytes. */
+	QThreadPool decoderPool;/**< worker threads that read and decode tiles. */
+	QSet<tileKey> pendingDecodes;/**< tiles being decoded in decoderPool. */
+	QSet<tileKey> pendingEncodes;/**< tiles put together from their children being encoded in decoderPool. */
+	tileWriter writer;/**< saves downloaded tiles to HDD in the background. */
+	QHash<QNetworkReply*,tile> activeDownloads;/**< requests in flight and the %tile they belong to. */
+	int maxDownloads;/**< maximum number of requests in flight to each host, the throttle may allow fewer. */
+	QHash<int,downloadThrottle*> throttles;/**< adaptive limits of each server used so far, by index. */
+	downloadThrottle * currentThrottle;/**< adaptive limits of the current server. */
+	QTimer * throttleTimer;/**< starts the downloads that had to wait for a retry or the rate limit. */
+	QTimer * timeoutTimer;/**< looks for requests that took too long. */
+	QSet<QNetworkReply*> timedOut;/**< requests aborted for taking too long. */
+	QHash<QNetworkReply*,hedgeRequest> hedges;/**< duplicate requests to mirrors in flight. */
+	QTimer * hedgeTimer;/**< looks for requests slow enough to be hedged. */
+	QVector<int> shardDownloads;/**< requests in flight to each host. */
+	QVector<int> mirrorDownloads;/**< duplicate requests in flight to each mirror. */
+	int prefetchMax;/**< maximum number of prefetched tiles queued or downloading, 0 disables prefetching. */
+	int prefetchBandwidth;/**< bytes/s allowed for prefetching, 0 for no limit. */
+	quint64 prefetchBytes;/**< bytes prefetched since prefetchClock was restarted. */
+	QElapsedTimer prefetchClock;/**< measures the 1s window prefetchBandwidth applies to. */
+	int prefetchLevel;/**< zoom level of the last prediction. */
 	QString folder;/**< root application folder. */
 	QMovie loadingAnim;/**< to show a 'loading' animation for yet unavailable tiles. */
 	QPixmap notAvailableTile;
 	servermanager servermgr;	
 
 	void renderMap(QPainter &);
+	void scheduleFrame();
+	void flushUpdates();
+	void renderLevel(QPainter &, int, qreal, qreal);
 	void downloadPicture();
+	void selectThrottle();
+	void tileDownloaded(tileKey, QNetworkReply *, QByteArray const &);
+	void hedgeReady(QNetworkReply *);
+	void sortDownloadQueue();
+	void prioritizeDownloads();
+	qint64 tilePriority(qint32, qint32);
+	void tileOffset(qint32, qint32, qint64 &, qint64 &);
+	void queuePrefetch(int, QPointF const &, QPointF const &);
+	void queuePanPrefetch();
 	void loadCache();
 	QString getTilePath(int, qint32);
-	QPixmap getTilePatch(int,quint32,quint32,int,int,int);
+	QString getTileFile(int, quint32, quint32);
+	tileKey memCacheKey(int, quint32, quint32);
+	bool loadTile(int, quint32, quint32, QPixmap &);
+	bool overQuota();
+	bool isVisible(tileKey);
+	bool isStale(tileKey);
+	bool isUnavailable(tileKey);
+	void storeMeta(tileKey, tileMeta const &);
+	void evictTile(tileKey);
+	quint64 evictionScore(cacheEntry const &);
+	bool getTilePatch(int,quint32,quint32,int,int,int,QPixmap &);
+	QPixmap getPlaceholder(int,quint32,quint32);
+	bool childrenCached(int,quint32,quint32,int,bool &);
+	bool drawChildren(QPainter &,int,quint32,quint32,QRect const &,int,bool &);
+	void saveComposite(int,quint32,quint32,QPixmap const &);
+	void saveTile(tileKey,QByteArray const &,quint32);
+	void updatePyramid();
 
 protected:
 	int zoom;/**< Map zoom level. */
@@ -123,23 +335,36 @@ protected:
 	int maxZoom;/**< Maximum zoom level (closest).*/
 
 	int tileSize; /**< size in px of the square %tile. */
-	quint32 cacheSize;/**< current %tile cache size in bytes. */
+	quint64 cacheSize;/**< current %tile cache size in bytes. */
 	//check QtMobility QGeoCoordinate
 	QPointF geocoords; /**< current longitude and latitude. */
 	QPixmap* imgBuffer;
-	QPixmap tmpbuff;
-	float buffzoomrate;
+	double fractionalZoom;/**< continuous zoom level, the buffer is drawn magnified by 2^(fractionalZoom-zoom). */
 
-	bool bufferDirty; /**< image buffer needs to be updated. */	
+	bool bufferDirty; /**< image buffer needs a full redraw (zoom, resize, server change). */	
 	void resizeEvent(QResizeEvent*);
 	void paintEvent(QPaintEvent *);
 	void updateTilesToRender();
 	void updateBuffer();
+	void scrollBuffer(tileSet const &);
+	void drawTile(QPainter &, qint32, qint32);
+	void redrawTile(int, quint32, quint32);
 	void updateContent();
+	void scheduleUpdate();
+	void prefetchPan(QPointF);
+	void prefetchZoom(QPointF, int);
 
 protected slots:
 	void slotDownloadProgress(qint64, qint64);
 	void slotDownloadReady(QNetworkReply *);
 	void slotError(QNetworkReply::NetworkError);
+	void slotTileDecoded(qulonglong, QImage, int, int);
+	void slotTileEncoded(qulonglong, QByteArray);
+	void slotEvict();
+	void slotFrame();
+	void slotMetrics();
+	void slotRetry();
+	void slotTimeouts();
+	void slotHedge();
 };
 #endif
@@ -7,6 +7,7 @@ CONFIG += qt debug
 DEPENDPATH += .
 INCLUDEPATH += .
 QT+=network xml
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 # Input
-HEADERS += cacamap.h myderivedmap.h testwidget.h servermanager.h
-SOURCES += cacamap.cpp main.cpp myderivedmap.cpp testwidget.cpp servermanager.cpp
+HEADERS += cacamap.h myderivedmap.h testwidget.h servermanager.h mercator.h tilekey.h tileloader.h tilewriter.h cacheindex.h packstore.h metastore.h mapmetrics.h throttle.h
+SOURCES += cacamap.cpp main.cpp myderivedmap.cpp testwidget.cpp servermanager.cpp mercator.cpp tileloader.cpp tilewriter.cpp cacheindex.cpp packstore.cpp metastore.cpp mapmetrics.cpp throttle.cpp
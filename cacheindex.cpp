@@ -0,0 +1,278 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+#include "cacheindex.h"
+#include <iostream>
+using namespace std;
+
+/**
+* constructor
+* @param _dir cache folder of the server, the index file is kept inside it
+*/
+cacheIndex::cacheIndex(QString const & _dir)
+{
+	dir = _dir;
+	file.setFileName(dir+"/"+INDEX_FILE);
+}
+
+/**
+* destructor
+*/
+cacheIndex::~cacheIndex()
+{
+	close();
+}
+
+/**
+* Reads the index into tiles
+* @param tiles gets the tiles and their sizes
+* @param totalSize gets the sum of the sizes
+* @return false if the index is missing or can't be trusted, then the folder has to be
+* rescanned and the index rebuilt
+* @see cacheIndex::rebuild
+*/
+bool cacheIndex::load(QHash<tileKey,cacheEntry> & tiles, quint64 & totalSize)
+{
+	QMutexLocker locker(&mutex);
+	if (file.isOpen())
+	{
+		file.close();
+	}
+	if (!file.open(QIODevice::ReadWrite))
+	{
+		return false;
+	}
+	qint64 size = file.size();
+	if (size < (qint64)sizeof(indexHeader))
+	{
+		return false;
+	}
+	uchar * map = file.map(0,size);
+	if (!map)
+	{
+		return false;
+	}
+	indexHeader const * header = (indexHeader const *)map;
+	if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION || !header->clean
+		|| header->signature != folderSignature())
+	{
+		file.unmap(map);
+		return false;
+	}
+	//a torn record at the end can only be there if the file wasn't closed properly
+	qint64 count = (size - sizeof(indexHeader))/sizeof(indexRecord);
+	indexRecord const * records = (indexRecord const *)(map + sizeof(indexHeader));
+	tiles.reserve((int)count);
+	qint64 removed = 0;
+	for (qint64 i=0; i<count; i++)
+	{
+		tileKey key;
+		key.id = records[i].key;
+		if (records[i].present)
+		{
+			tiles.insert(key,cacheEntry(records[i].size));
+		}
+		else
+		{
+			tiles.remove(key);
+			removed++;
+		}
+	}
+	file.unmap(map);
+	totalSize = 0;
+	QHash<tileKey,cacheEntry>::const_iterator i;
+	for (i = tiles.constBegin(); i != tiles.constEnd(); ++i)
+	{
+		totalSize += i.value().size;
+	}
+	locker.unlock();
+	//dont let removals pile up forever
+	if (removed > count/2)
+	{
+		rebuild(tiles);
+	}
+	else
+	{
+		writeHeader(false);
+	}
+	return true;
+}
+
+/**
+* Lists the tiles in the cache folder, the slow way
+* Leftovers of interrupted writes are deleted on the way.
+* @param tiles gets the tiles and their sizes
+* @param totalSize gets the sum of the sizes
+* @see cacheIndex::rebuild
+*/
+void cacheIndex::scan(QHash<tileKey,cacheEntry> & tiles, quint64 & totalSize)
+{
+	totalSize = 0;
+	tiles.clear();
+	QFileInfoList zoom = QDir(dir).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
+	for (int i=0; i< zoom.size(); i++)
+	{
+		int zoomLevel = zoom.at(i).fileName().toInt();
+		QFileInfoList longitudes = QDir(zoom.at(i).filePath()).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
+		for (int j=0; j< longitudes.size(); j++)
+		{
+			quint32 lon = longitudes.at(j).fileName().toUInt();
+			QFileInfoList latitudes = QDir(longitudes.at(j).filePath()).entryInfoList(QDir::Files | QDir::NoDotAndDotDot);
+			for (int k=0; k< latitudes.size(); k++)
+			{
+				//leftovers of an interrupted write
+				if (latitudes.at(k).suffix() == "tmp")
+				{
+					QFile::remove(latitudes.at(k).filePath());
+					continue;
+				}
+				totalSize += latitudes.at(k).size();
+				tiles.insert(tileKey(zoomLevel,lon,latitudes.at(k).baseName().toUInt()),cacheEntry(latitudes.at(k).size()));
+			}
+		}
+	}
+}
+
+/**
+* Rewrites the index from scratch with the given tiles
+*/
+void cacheIndex::rebuild(QHash<tileKey,cacheEntry> const & tiles)
+{
+	QMutexLocker locker(&mutex);
+	if (file.isOpen())
+	{
+		file.close();
+	}
+	QDir().mkpath(dir);
+	if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate))
+	{
+		cout<<"couldn't open cache index "<<file.fileName().toStdString()<<endl;
+		return;
+	}
+	indexHeader header;
+	header.magic = INDEX_MAGIC;
+	header.version = INDEX_VERSION;
+	header.clean = 0;
+	header.reserved = 0;
+	header.signature = 0;
+	QByteArray buffer;
+	buffer.reserve(sizeof(indexHeader) + tiles.size()*sizeof(indexRecord));
+	buffer.append((char const *)&header,sizeof(header));
+	QHash<tileKey,cacheEntry>::const_iterator i;
+	for (i = tiles.constBegin(); i != tiles.constEnd(); ++i)
+	{
+		indexRecord record;
+		record.key = i.key().id;
+		record.size = i.value().size;
+		record.present = 1;
+		buffer.append((char const *)&record,sizeof(record));
+	}
+	file.write(buffer);
+	file.flush();
+}
+
+/**
+* Records that a %tile was saved
+* @param key the %tile
+* @param size file size in bytes
+*/
+void cacheIndex::append(tileKey key, quint32 size)
+{
+	QMutexLocker locker(&mutex);
+	writeRecord(key,size,1);
+}
+
+/**
+* Records that a %tile was deleted
+*/
+void cacheIndex::remove(tileKey key)
+{
+	QMutexLocker locker(&mutex);
+	writeRecord(key,0,0);
+}
+
+/**
+* Marks the index as trustworthy and closes it
+* Must be called once no more tiles are being written to the folder.
+*/
+void cacheIndex::close()
+{
+	QMutexLocker locker(&mutex);
+	if (file.isOpen())
+	{
+		locker.unlock();
+		writeHeader(true);
+		locker.relock();
+		file.close();
+	}
+}
+
+/**
+* @return a value that changes when zoom level folders are added or removed, or when
+* column folders are added to or removed from them. It only takes one stat per zoom level.
+*/
+quint64 cacheIndex::folderSignature()
+{
+	quint64 signature = 0;
+	QFileInfoList zoom = QDir(dir).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
+	for (int i=0; i< zoom.size(); i++)
+	{
+		tileKey level(zoom.at(i).fileName().toInt(),0,0);
+		quint64 mtime = zoom.at(i).lastModified().toTime_t();
+		signature += (quint64)qHash(level) * (mtime | 1);
+	}
+	return signature;
+}
+
+/**
+* Updates the header
+* @param clean true when closing, false when the index starts being used
+*/
+void cacheIndex::writeHeader(bool clean)
+{
+	indexHeader header;
+	header.magic = INDEX_MAGIC;
+	header.version = INDEX_VERSION;
+	header.clean = clean;
+	header.reserved = 0;
+	header.signature = clean ? folderSignature() : 0;
+	QMutexLocker locker(&mutex);
+	if (file.isOpen() && file.seek(0))
+	{
+		file.write((char const *)&header,sizeof(header));
+		file.flush();
+	}
+}
+
+/**
+* Appends a record at the end of the file, mutex must be locked
+* The file is reopened if needed, e.g. for tiles of a server that is
+* no longer selected that were still waiting to be written.
+*/
+void cacheIndex::writeRecord(tileKey key, quint32 size, quint32 present)
+{
+	if (!file.isOpen() && (!file.exists() || !file.open(QIODevice::ReadWrite)))
+	{
+		return;
+	}
+	indexRecord record;
+	record.key = key.id;
+	record.size = size;
+	record.present = present;
+	if (file.seek(file.size()))
+	{
+		file.write((char const *)&record,sizeof(record));
+		file.flush();
+	}
+}
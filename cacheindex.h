@@ -0,0 +1,89 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef CACHEINDEX_H
+#define CACHEINDEX_H
+
+#include <QtCore>
+#include "tilekey.h"
+
+/**
+* What's known about a cached %tile
+*/
+struct cacheEntry
+{
+	quint32 size;/**< file size in bytes. */
+	quint32 lastAccess;/**< cacaMap::accessTick when it was last used. */
+	quint32 hits;/**< number of times it was used. */
+	cacheEntry(quint32 _size=0):size(_size),lastAccess(0),hits(0){}
+};
+
+/**
+* Header of an index file
+*/
+struct indexHeader
+{
+	quint32 magic;/**< INDEX_MAGIC, also tells if the file has the right endianness. */
+	quint32 version;/**< INDEX_VERSION. */
+	quint32 clean;/**< 1 if the file was closed properly, 0 while it's in use. */
+	quint32 reserved;/**< padding, always 0. */
+	quint64 signature;/**< summary of the cache folder when the file was closed. */
+};
+
+/**
+* One entry of an index file. Later entries for the same %tile override earlier ones.
+*/
+struct indexRecord
+{
+	quint64 key;/**< packed tileKey. */
+	quint32 size;/**< file size in bytes. */
+	quint32 present;/**< 1 if the %tile was added, 0 if it was removed. */
+};
+
+#define INDEX_MAGIC 0x58494d43 //"CMIX"
+#define INDEX_VERSION 1
+#define INDEX_FILE "index.dat"
+
+/**
+* Persistent list of the tiles in a server's cache folder
+* It's a fixed size header followed by fixed size records, so loading it is
+* a single mmap. Records are appended as tiles are saved, so it doesn't need
+* to be rewritten. It's trusted only if it was closed properly and the zoom
+* level folders haven't changed since, otherwise the folder has to be rescanned.
+* Appending is thread safe.
+*/
+class cacheIndex
+{
+public:
+	cacheIndex(QString const &);
+	~cacheIndex();
+	bool load(QHash<tileKey,cacheEntry> &, quint64 &);
+	void scan(QHash<tileKey,cacheEntry> &, quint64 &);
+	void rebuild(QHash<tileKey,cacheEntry> const &);
+	void append(tileKey, quint32);
+	void remove(tileKey);
+	void close();
+
+private:
+	quint64 folderSignature();
+	void writeHeader(bool);
+	void writeRecord(tileKey, quint32, quint32);
+
+	QMutex mutex;/**< guards file. */
+	QString dir;/**< cache folder of the server. */
+	QFile file;/**< the index file, open while the folder is in use. */
+};
+
+#endif
@@ -0,0 +1,334 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "loadtest.h"
+#include <iostream>
+using namespace std;
+
+/**
+* ms between samples of the requests in flight
+*/
+#define SAMPLE_INTERVAL 100
+/**
+* where every test starts
+*/
+#define START_CENTER QPointF(23.8564,61.4667)
+#define START_ZOOM 14
+
+/**
+* constructor
+*/
+loadTest::loadTest(mockConfig const & config, QObject * _parent):QObject(_parent)
+{
+	server = new mockTileServer(config,this);
+	map = 0;
+	clientConnections = 0;
+	timeout = 10000;
+	sampler = new QTimer(this);
+	sampler->setInterval(SAMPLE_INTERVAL);
+	connect(sampler,SIGNAL(timeout()),this,SLOT(slotSample()));
+}
+
+/**
+* destructor
+*/
+loadTest::~loadTest()
+{
+	delete map;
+	if (!root.isEmpty())
+	{
+		removeAll(root);
+	}
+}
+
+/**
+* Parses a script, steps are separated by ';':
+* "pan DX DY" drags the map DX,DY px, "zoom LEVEL" jumps to a level,
+* "wait MS" lets time pass without waiting for the view.
+* @return false if a step can't be parsed
+*/
+bool loadTest::setScript(QString const & script)
+{
+	steps.clear();
+	QStringList parts = script.split(';',QString::SkipEmptyParts);
+	for (int i=0; i<parts.size(); i++)
+	{
+		QStringList words = parts.at(i).simplified().split(' ');
+		loadStep step;
+		step.text = parts.at(i).simplified();
+		step.b = 0;
+		bool ok = true, okb = true;
+		if (words.first() == "pan" && words.size() == 3)
+		{
+			step.type = loadStep::PAN;
+			step.a = words.at(1).toInt(&ok);
+			step.b = words.at(2).toInt(&okb);
+		}
+		else if (words.first() == "zoom" && words.size() == 2)
+		{
+			step.type = loadStep::ZOOM;
+			step.a = words.at(1).toInt(&ok);
+		}
+		else if (words.first() == "wait" && words.size() == 2)
+		{
+			step.type = loadStep::WAIT;
+			step.a = words.at(1).toInt(&ok);
+		}
+		else
+		{
+			ok = false;
+		}
+		if (!ok || !okb)
+		{
+			cout<<"bad step: "<<step.text.toStdString()<<endl;
+			return false;
+		}
+		steps.append(step);
+	}
+	return true;
+}
+
+/**
+* @param connections requests the map keeps in flight, written as <connections> in the config
+*/
+void loadTest::setClientConnections(int connections)
+{
+	clientConnections = connections;
+}
+
+/**
+* @param ms time a step may take before it's given up on
+*/
+void loadTest::setTimeout(int ms)
+{
+	timeout = ms;
+}
+
+/**
+* Writes a tileservers.xml with a single server pointing to the mock one
+*/
+bool loadTest::writeServers(quint16 port)
+{
+	QFile file(root+"/tileservers.xml");
+	if (!file.open(QIODevice::WriteOnly))
+	{
+		return false;
+	}
+	QTextStream out(&file);
+	out<<"<cacamap>\n"
+		<<"\t<server>\n"
+		<<"\t\t<name>mock</name>\n"
+		<<"\t\t<url><![CDATA[http://127.0.0.1:"<<port<<"/%z/%x/%y.png]]></url>\n"
+		<<"\t\t<folder>mock</folder>\n"
+		<<"\t\t<filepath><![CDATA[/%z/%x/]]></filepath>\n"
+		<<"\t\t<tile><![CDATA[%y.png]]></tile>\n";
+	if (clientConnections > 0)
+	{
+		out<<"\t\t<connections>"<<clientConnections<<"</connections>\n"
+			<<"\t\t<maxconnections>"<<clientConnections<<"</maxconnections>\n";
+	}
+	out<<"\t</server>\n"
+		<<"</cacamap>\n";
+	return true;
+}
+
+/**
+* Checks how far the visible tiles are
+* @param failed gets the number of visible tiles that won't arrive (server errors)
+* @return number of visible tiles still on their way, 0 when the view is complete
+*/
+int loadTest::viewportState(int & failed)
+{
+	failed = 0;
+	if (map->contentDirty || map->bufferDirty)
+	{
+		return -1;
+	}
+	int missing = 0;
+	tileSet const & view = map->tilesToRender;
+	qint32 numtiles = 1<<view.zoom;
+	for (qint32 i = view.left; i <= view.right; i++)
+	{
+		qint32 valx = ((i<0)*numtiles + i%numtiles)%numtiles;
+		for (qint32 j = qMax(0,view.top); j <= qMin(numtiles-1,view.bottom); j++)
+		{
+			tileKey key(view.zoom,valx,j);
+			bool any = false;
+			if (map->tileCache.contains(key))
+			{
+				if (!map->memCache.contains(map->memCacheKey(view.zoom,valx,j)))
+				{
+					missing++;
+				}
+			}
+			else if (map->isUnavailable(key))
+			{
+				continue;
+			}
+			else if (map->downloadQueue.contains(key) || (view.zoom < map->maxZoom && map->childrenCached(view.zoom,valx,j,UNDERZOOM_DEPTH,any)))
+			{
+				missing++;
+			}
+			//not cached, not queued: its request failed
+			else
+			{
+				failed++;
+			}
+		}
+	}
+	return missing;
+}
+
+/**
+* Does what a step says
+*/
+void loadTest::apply(loadStep const & step)
+{
+	if (step.type == loadStep::PAN)
+	{
+		int zoom = map->getZoom();
+		longPoint p = myMercator::geoCoordToPixel(map->getGeoCoords(),zoom,256);
+		p.x += step.a;
+		p.y += step.b;
+		map->setGeoCoords(myMercator::pixelToGeoCoord(p,zoom,256));
+	}
+	else if (step.type == loadStep::ZOOM)
+	{
+		map->setZoom(step.a);
+	}
+}
+
+/**
+* Runs the script against a fresh cache
+* @return 0 if every step completed, 1 otherwise
+*/
+int loadTest::run()
+{
+	if (!server->listen(QHostAddress::LocalHost))
+	{
+		cout<<"couldn't start the mock server"<<endl;
+		return 1;
+	}
+	root = QDir::tempPath()+QString("/cacamap-loadtest-%1").arg(QCoreApplication::applicationPid());
+	QDir().mkpath(root);
+	if (!writeServers(server->serverPort()))
+	{
+		cout<<"couldn't write "<<root.toStdString()<<"/tileservers.xml"<<endl;
+		return 1;
+	}
+	//cacaMap reads tileservers.xml and the cache from the working folder
+	QString oldCurrent = QDir::currentPath();
+	QDir::setCurrent(root);
+	map = new cacaMap;
+	QDir::setCurrent(oldCurrent);
+	map->resize(800,600);
+	map->show();
+	map->setGeoCoords(START_CENTER);
+	map->setZoom(START_ZOOM);
+
+	clock.start();
+	sampler->start();
+	samples.append("ms,server_active,client_active,queued");
+	int incomplete = 0;
+	//the initial view is step 0
+	for (int s=-1; s<steps.size(); s++)
+	{
+		QString text = "start";
+		if (s >= 0)
+		{
+			text = steps.at(s).text;
+			apply(steps.at(s));
+		}
+		QElapsedTimer stepClock;
+		stepClock.start();
+		qint64 limit = timeout;
+		if (s >= 0 && steps.at(s).type == loadStep::WAIT)
+		{
+			limit = steps.at(s).a;
+		}
+		int failed = 0;
+		int missing = -1;
+		while (stepClock.elapsed() < limit)
+		{
+			QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+			missing = viewportState(failed);
+			if (missing == 0 && (s < 0 || steps.at(s).type != loadStep::WAIT))
+			{
+				break;
+			}
+		}
+		if (s >= 0 && steps.at(s).type == loadStep::WAIT)
+		{
+			cout<<"step="<<s+1<<" action=\""<<text.toStdString()<<"\""<<endl;
+			continue;
+		}
+		if (missing)
+		{
+			incomplete++;
+		}
+		cout<<"step="<<s+1<<" action=\""<<text.toStdString()<<"\" viewport_ms="<<stepClock.elapsed()
+			<<" complete="<<(missing ? 0 : 1)<<" failed_tiles="<<failed<<endl;
+	}
+	sampler->stop();
+
+	mockStats stats = server->getStats();
+	cout<<"total_ms="<<clock.elapsed()<<endl
+		<<"requests="<<stats.requests<<endl
+		<<"tiles="<<stats.tiles<<endl
+		<<"bytes="<<stats.bytes<<endl
+		<<"duplicates="<<stats.duplicates<<endl
+		<<"wasted="<<stats.aborted<<endl
+		<<"errors="<<stats.errors<<endl
+		<<"not_found="<<stats.notFound<<endl
+		<<"not_modified="<<stats.notModified<<endl
+		<<"peak_server_active="<<stats.peakActive<<endl
+		<<"metrics="<<map->getMetricsJson().toStdString()<<endl;
+	cout<<"concurrency:"<<endl;
+	for (int i=0; i<samples.size(); i++)
+	{
+		cout<<samples.at(i).toStdString()<<endl;
+	}
+	return incomplete ? 1 : 0;
+}
+
+/**
+* Records the requests in flight on both ends
+*/
+void loadTest::slotSample()
+{
+	samples.append(QString("%1,%2,%3,%4").arg(clock.elapsed()).arg(server->activeRequests())
+		.arg(map->activeDownloads.size()).arg(map->downloadQueue.size()));
+}
+
+/**
+* Deletes a folder and everything in it
+*/
+bool loadTest::removeAll(QString const & path)
+{
+	QDir dir(path);
+	QFileInfoList entries = dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot | QDir::Hidden);
+	for (int i=0; i<entries.size(); i++)
+	{
+		if (entries.at(i).isDir())
+		{
+			removeAll(entries.at(i).filePath());
+		}
+		else
+		{
+			QFile::remove(entries.at(i).filePath());
+		}
+	}
+	return dir.rmdir(path);
+}
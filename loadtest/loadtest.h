@@ -0,0 +1,73 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef LOADTEST_H
+#define LOADTEST_H
+
+#include "cacamap.h"
+#include "mocktileserver.h"
+
+/**
+* One step of a load test script
+*/
+struct loadStep
+{
+	enum stepType {PAN, ZOOM, WAIT};
+	stepType type;
+	int a;/**< dx in px for PAN, level for ZOOM, ms for WAIT. */
+	int b;/**< dy in px for PAN. */
+	QString text;/**< the step as written in the script. */
+};
+
+/**
+* Drives a cacaMap against a mockTileServer through a script of pans and zooms
+* After every step it waits until the whole view is on screen, and in the end
+* it prints what the server saw, as key=value lines and a csv of the number of
+* requests in flight over time.
+*/
+class loadTest : public QObject
+{
+
+Q_OBJECT
+
+public:
+	loadTest(mockConfig const &, QObject * _parent=0);
+	~loadTest();
+	bool setScript(QString const &);
+	void setClientConnections(int);
+	void setTimeout(int);
+	int run();
+
+private:
+	bool writeServers(quint16);
+	int viewportState(int &);
+	void apply(loadStep const &);
+	static bool removeAll(QString const &);
+
+	mockTileServer * server;
+	cacaMap * map;
+	QList<loadStep> steps;
+	int clientConnections;/**< requests the map keeps in flight, 0 for the default. */
+	int timeout;/**< ms a step may take before it's given up on. */
+	QString root;/**< temporary folder with the config and the cache. */
+	QElapsedTimer clock;/**< time since the test started. */
+	QStringList samples;/**< csv lines of the concurrency over time. */
+	QTimer * sampler;
+
+private slots:
+	void slotSample();
+};
+
+#endif
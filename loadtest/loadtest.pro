@@ -0,0 +1,16 @@
+######################################################################
+# Load test of the download pipeline against a local mock tile server
+# run with: ./loadtest -platform offscreen [--latency 50-300] [--script "pan 300 0; zoom 13"]
+######################################################################
+
+TEMPLATE = app
+TARGET = loadtest
+CONFIG += qt console
+CONFIG -= app_bundle
+QT += network xml
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+DEPENDPATH += . ..
+INCLUDEPATH += ..
+# Input
+HEADERS += loadtest.h mocktileserver.h ../cacamap.h ../servermanager.h ../mercator.h ../tilekey.h ../tileloader.h ../tilewriter.h ../cacheindex.h ../packstore.h ../metastore.h ../mapmetrics.h ../throttle.h
+SOURCES += main.cpp loadtest.cpp mocktileserver.cpp ../cacamap.cpp ../servermanager.cpp ../mercator.cpp ../tileloader.cpp ../tilewriter.cpp ../cacheindex.cpp ../packstore.cpp ../metastore.cpp ../mapmetrics.cpp ../throttle.cpp
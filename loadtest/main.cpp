@@ -0,0 +1,101 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+/** @file main.cpp
+* Load test of the download pipeline against a local mock tile server
+* usage: loadtest [--latency MIN-MAX] [--bandwidth BYTES] [--errors RATE] [--notfound RATE]
+*        [--server-connections N] [--client-connections N] [--tile-bytes N]
+*        [--timeout MS] [--script "pan DX DY; zoom LEVEL; wait MS"]
+*/
+
+#include <QtGui>
+#include <iostream>
+#include "loadtest.h"
+using namespace std;
+
+/**
+* what the test does when there's no --script
+*/
+#define DEFAULT_SCRIPT "pan 300 0; pan 300 0; pan 0 300; zoom 13; zoom 15; pan -600 0; zoom 14"
+
+static int usage()
+{
+	cout<<"usage: loadtest [--latency MIN-MAX] [--bandwidth BYTES] [--errors RATE] [--notfound RATE]"<<endl
+		<<"                [--server-connections N] [--client-connections N] [--tile-bytes N]"<<endl
+		<<"                [--timeout MS] [--script STEPS]"<<endl
+		<<"  --latency             ms before each response starts (default 50-300)"<<endl
+		<<"  --bandwidth           bytes/s the server sends in total (default no limit)"<<endl
+		<<"  --errors              fraction of requests answered with 500 (default 0)"<<endl
+		<<"  --notfound            fraction of requests answered with 404 (default 0)"<<endl
+		<<"  --server-connections  requests the server handles at once (default no limit)"<<endl
+		<<"  --client-connections  requests the map keeps in flight (default cacaMap's)"<<endl
+		<<"  --tile-bytes          size of each tile (default 20000)"<<endl
+		<<"  --timeout             ms a step may take to complete the view (default 10000)"<<endl
+		<<"  --script              steps separated by ';': pan DX DY, zoom LEVEL, wait MS"<<endl
+		<<"                        (default \""<<DEFAULT_SCRIPT<<"\")"<<endl;
+	return 2;
+}
+
+int main (int argc, char **argv)
+{
+	QApplication app(argc, argv);
+	QStringList args = app.arguments();
+	QHash<QString,QString> options;
+	for (int i=1; i<args.size(); i++)
+	{
+		//leave qt's own options (-platform offscreen) alone
+		if (!args.at(i).startsWith("--"))
+		{
+			continue;
+		}
+		if (i+1 == args.size())
+		{
+			return usage();
+		}
+		options.insert(args.at(i).mid(2),args.at(i+1));
+		i++;
+	}
+
+	mockConfig config;
+	bool ok = true;
+	if (options.contains("latency"))
+	{
+		QStringList range = options.value("latency").split('-');
+		bool maxOk = true;
+		config.latencyMin = range.first().toInt(&ok);
+		config.latencyMax = range.last().toInt(&maxOk);
+		ok = ok && maxOk && range.size() <= 2 && config.latencyMin >= 0 && config.latencyMin <= config.latencyMax;
+	}
+	bool bandwidthOk = true, errorsOk = true, notFoundOk = true, serverOk = true, bytesOk = true;
+	config.bandwidth = options.value("bandwidth","0").toLongLong(&bandwidthOk);
+	config.errorRate = options.value("errors","0").toDouble(&errorsOk);
+	config.notFoundRate = options.value("notfound","0").toDouble(&notFoundOk);
+	config.maxRequests = options.value("server-connections","0").toInt(&serverOk);
+	config.tileBytes = options.value("tile-bytes",QString::number(config.tileBytes)).toInt(&bytesOk);
+	if (!ok || !bandwidthOk || !errorsOk || !notFoundOk || !serverOk || !bytesOk
+		|| config.errorRate + config.notFoundRate > 1 || config.tileBytes <= 0)
+	{
+		return usage();
+	}
+
+	loadTest test(config);
+	if (!test.setScript(options.value("script",DEFAULT_SCRIPT)))
+	{
+		return usage();
+	}
+	test.setClientConnections(options.value("client-connections","0").toInt());
+	test.setTimeout(options.value("timeout","10000").toInt());
+	return test.run();
+}
@@ -0,0 +1,287 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "mocktileserver.h"
+#include <QtGui>
+
+/**
+* ms between slices of the responses
+*/
+#define PUMP_INTERVAL 10
+
+/**
+* constructor, call listen() to start serving
+*/
+mockTileServer::mockTileServer(mockConfig const & _config, QObject * _parent):QTcpServer(_parent)
+{
+	config = _config;
+	QImage image(256,256,QImage::Format_RGB32);
+	image.fill(qRgb(120,160,120));
+	QBuffer buffer(&body);
+	buffer.open(QIODevice::WriteOnly);
+	image.save(&buffer,"PNG");
+	//decoders stop at the end of the image, so padding after it is harmless
+	if (body.size() < config.tileBytes)
+	{
+		body.append(QByteArray(config.tileBytes - body.size(),'\0'));
+	}
+	lastPump = 0;
+	clock.start();
+	pump = new QTimer(this);
+	pump->setInterval(PUMP_INTERVAL);
+	connect(pump,SIGNAL(timeout()),this,SLOT(slotPump()));
+	pump->start();
+	connect(this,SIGNAL(newConnection()),this,SLOT(slotNewConnection()));
+}
+
+/**
+* destructor
+*/
+mockTileServer::~mockTileServer()
+{
+	qDeleteAll(waiting);
+	qDeleteAll(active);
+}
+
+/**
+* @return counters so far
+*/
+mockStats mockTileServer::getStats()
+{
+	return stats;
+}
+
+/**
+* @return number of requests in their latency or being sent
+*/
+int mockTileServer::activeRequests()
+{
+	return active.size();
+}
+
+void mockTileServer::slotNewConnection()
+{
+	while (hasPendingConnections())
+	{
+		QTcpSocket * socket = nextPendingConnection();
+		connect(socket,SIGNAL(readyRead()),this,SLOT(slotReadyRead()));
+		connect(socket,SIGNAL(disconnected()),this,SLOT(slotDisconnected()));
+		buffers.insert(socket,QByteArray());
+	}
+}
+
+void mockTileServer::slotReadyRead()
+{
+	QTcpSocket * socket = qobject_cast<QTcpSocket*>(sender());
+	if (socket)
+	{
+		buffers[socket].append(socket->readAll());
+		parseRequests(socket);
+	}
+}
+
+/**
+* The client closed the connection, whatever it had asked for is wasted
+* Requests being handled notice it when they are about to be sent.
+*/
+void mockTileServer::slotDisconnected()
+{
+	QTcpSocket * socket = qobject_cast<QTcpSocket*>(sender());
+	buffers.remove(socket);
+	QList<mockRequest*>::iterator i = waiting.begin();
+	while (i != waiting.end())
+	{
+		if ((*i)->socket == socket)
+		{
+			stats.aborted++;
+			delete *i;
+			i = waiting.erase(i);
+		}
+		else
+		{
+			++i;
+		}
+	}
+	for (int k=0; k<active.size(); k++)
+	{
+		if (active.at(k)->socket == socket)
+		{
+			active[k]->socket = 0;
+		}
+	}
+	socket->deleteLater();
+}
+
+/**
+* Turns complete request headers into queued responses
+*/
+void mockTileServer::parseRequests(QTcpSocket * socket)
+{
+	QByteArray & buffer = buffers[socket];
+	int end;
+	while ((end = buffer.indexOf("\r\n\r\n")) >= 0)
+	{
+		QList<QByteArray> lines = buffer.left(end).split('\n');
+		buffer.remove(0,end+4);
+		QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+		if (requestLine.size() < 2)
+		{
+			continue;
+		}
+		QByteArray ifNoneMatch;
+		for (int i=1; i<lines.size(); i++)
+		{
+			if (lines.at(i).toLower().startsWith("if-none-match:"))
+			{
+				ifNoneMatch = lines.at(i).mid(14).trimmed();
+			}
+		}
+		stats.requests++;
+		mockRequest * request = new mockRequest;
+		request->socket = socket;
+		request->path = requestLine.at(1);
+		request->written = 0;
+		request->due = 0;
+		request->sending = false;
+
+		QByteArray etag = "\""+request->path+"\"";
+		QByteArray content;
+		QByteArray reason;
+		double r = qrand()/(RAND_MAX + 1.0);
+		if (r < config.errorRate)
+		{
+			request->status = 500;
+			reason = "Internal Server Error";
+		}
+		else if (r < config.errorRate + config.notFoundRate)
+		{
+			request->status = 404;
+			reason = "Not Found";
+		}
+		else if (ifNoneMatch == etag)
+		{
+			request->status = 304;
+			reason = "Not Modified";
+		}
+		else
+		{
+			request->status = 200;
+			reason = "OK";
+			content = body;
+		}
+		request->response = "HTTP/1.1 "+QByteArray::number(request->status)+" "+reason+"\r\n"
+			+"Content-Type: image/png\r\n"
+			+"Content-Length: "+QByteArray::number(content.size())+"\r\n"
+			+"ETag: "+etag+"\r\n"
+			+"Cache-Control: max-age=86400\r\n"
+			+"Connection: keep-alive\r\n\r\n"
+			+content;
+		waiting.append(request);
+	}
+	startRequests();
+}
+
+/**
+* Moves requests out of the line while there's room, and gives them their latency
+*/
+void mockTileServer::startRequests()
+{
+	while (!waiting.isEmpty() && (!config.maxRequests || active.size() < config.maxRequests))
+	{
+		mockRequest * request = waiting.takeFirst();
+		int spread = qMax(0,config.latencyMax - config.latencyMin);
+		request->due = clock.elapsed() + config.latencyMin + (spread ? qrand()%(spread+1) : 0);
+		active.append(request);
+	}
+	stats.peakActive = qMax(stats.peakActive,active.size());
+}
+
+/**
+* Sends the next slice of every response whose latency is over
+* The bandwidth is split evenly between them.
+*/
+void mockTileServer::slotPump()
+{
+	qint64 now = clock.elapsed();
+	qint64 budget = config.bandwidth*(now - lastPump)/1000;
+	lastPump = now;
+	QList<mockRequest*> sending;
+	for (int i=0; i<active.size(); i++)
+	{
+		if (!active.at(i)->sending && active.at(i)->due <= now)
+		{
+			active[i]->sending = true;
+		}
+		if (active.at(i)->sending)
+		{
+			sending.append(active.at(i));
+		}
+	}
+	if (sending.isEmpty())
+	{
+		return;
+	}
+	qint64 share = qMax((qint64)1,budget/sending.size());
+	for (int i=0; i<sending.size(); i++)
+	{
+		mockRequest * request = sending.at(i);
+		if (!request->socket)
+		{
+			active.removeOne(request);
+			stats.aborted++;
+			delete request;
+			startRequests();
+			continue;
+		}
+		int left = request->response.size() - request->written;
+		int slice = config.bandwidth ? (int)qMin((qint64)left,share) : left;
+		request->socket->write(request->response.constData() + request->written,slice);
+		request->written += slice;
+		stats.bytes += slice;
+		if (request->written == request->response.size())
+		{
+			finishRequest(request);
+		}
+	}
+}
+
+/**
+* Counts a completely sent response and lets the next request in
+*/
+void mockTileServer::finishRequest(mockRequest * request)
+{
+	switch (request->status)
+	{
+		case 200:
+			stats.tiles++;
+			if (sent.contains(request->path))
+			{
+				stats.duplicates++;
+			}
+			sent.insert(request->path);
+			break;
+		case 304:
+			stats.notModified++;
+			break;
+		case 404:
+			stats.notFound++;
+			break;
+		default:
+			stats.errors++;
+	}
+	active.removeOne(request);
+	delete request;
+	startRequests();
+}
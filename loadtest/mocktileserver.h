@@ -0,0 +1,107 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef MOCKTILESERVER_H
+#define MOCKTILESERVER_H
+
+#include <QtCore>
+#include <QtNetwork>
+
+/**
+* How the mock server behaves
+*/
+struct mockConfig
+{
+	int latencyMin;/**< shortest ms before a response starts. */
+	int latencyMax;/**< longest ms before a response starts, latency is uniform in between. */
+	qint64 bandwidth;/**< bytes/s shared by all responses, 0 for no limit. */
+	double errorRate;/**< fraction of requests answered with 500. */
+	double notFoundRate;/**< fraction of requests answered with 404. */
+	int maxRequests;/**< requests handled at once, the rest wait in line. 0 for no limit. */
+	int tileBytes;/**< size of each %tile. */
+	mockConfig():latencyMin(50),latencyMax(300),bandwidth(0),errorRate(0),notFoundRate(0),maxRequests(0),tileBytes(20000){}
+};
+
+/**
+* What the mock server has seen
+*/
+struct mockStats
+{
+	quint64 requests;/**< requests received. */
+	quint64 tiles;/**< tiles sent completely. */
+	quint64 bytes;/**< bytes sent, headers included. */
+	quint64 duplicates;/**< tiles sent completely that had been sent before. */
+	quint64 aborted;/**< requests the client gave up on before getting the whole response. */
+	quint64 errors;/**< 500s sent. */
+	quint64 notFound;/**< 404s sent. */
+	quint64 notModified;/**< 304s sent. */
+	int peakActive;/**< most requests being handled at once. */
+	mockStats():requests(0),tiles(0),bytes(0),duplicates(0),aborted(0),errors(0),notFound(0),notModified(0),peakActive(0){}
+};
+
+/**
+* A request waiting in line, waiting for its latency or being sent
+*/
+struct mockRequest
+{
+	QPointer<QTcpSocket> socket;/**< connection it came from. */
+	QByteArray path;/**< requested path. */
+	QByteArray response;/**< status line, headers and body. */
+	int written;/**< bytes of response sent so far. */
+	int status;/**< HTTP status of the response. */
+	qint64 due;/**< ms on the server clock when its latency is over. */
+	bool sending;/**< latency is over, the response is going out. */
+};
+
+/**
+* Minimal HTTP/1.1 %tile server on localhost for load testing
+* Any GET is answered with the same PNG, padded to mockConfig::tileBytes, with an
+* ETag so revalidations get 304s. Connections are kept alive.
+*/
+class mockTileServer : public QTcpServer
+{
+
+Q_OBJECT
+
+public:
+	mockTileServer(mockConfig const &, QObject * _parent=0);
+	~mockTileServer();
+	mockStats getStats();
+	int activeRequests();
+
+private:
+	void startRequests();
+	void finishRequest(mockRequest *);
+	void parseRequests(QTcpSocket *);
+
+	mockConfig config;
+	mockStats stats;
+	QByteArray body;/**< %tile sent for every request. */
+	QHash<QTcpSocket*,QByteArray> buffers;/**< received data not parsed yet, by connection. */
+	QList<mockRequest*> waiting;/**< requests beyond the mockConfig::maxRequests limit. */
+	QList<mockRequest*> active;/**< requests in their latency or being sent. */
+	QSet<QByteArray> sent;/**< paths sent completely, to count duplicates. */
+	QTimer * pump;/**< starts responses whose latency is over and sends the next slice of them. */
+	QElapsedTimer clock;/**< time since the server was created. */
+	qint64 lastPump;/**< ms on clock of the last slice. */
+
+private slots:
+	void slotNewConnection();
+	void slotReadyRead();
+	void slotDisconnected();
+	void slotPump();
+};
+
+#endif
@@ -0,0 +1,229 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "mapmetrics.h"
+
+/**
+* constructor
+*/
+histogram::histogram()
+{
+	reset();
+}
+
+/**
+* Adds a value
+*/
+void histogram::add(quint64 value)
+{
+	int bucket = 0;
+	quint64 v = value;
+	while (v && bucket < HISTOGRAM_BUCKETS-1)
+	{
+		v >>= 1;
+		bucket++;
+	}
+	buckets[bucket]++;
+	total++;
+	sumValues += value;
+	if (value > maxValue)
+	{
+		maxValue = value;
+	}
+}
+
+/**
+* Forgets every value
+*/
+void histogram::reset()
+{
+	for (int i=0; i<HISTOGRAM_BUCKETS; i++)
+	{
+		buckets[i] = 0;
+	}
+	total = 0;
+	sumValues = 0;
+	maxValue = 0;
+}
+
+/**
+* Halves every count, so the values added from now on weigh as much as all the older ones
+* The sum and the largest value are kept as they are.
+*/
+void histogram::decay()
+{
+	total = 0;
+	for (int i=0; i<HISTOGRAM_BUCKETS; i++)
+	{
+		buckets[i] /= 2;
+		total += buckets[i];
+	}
+}
+
+/**
+* @return number of values added
+*/
+quint64 histogram::count() const
+{
+	return total;
+}
+
+/**
+* @return sum of the values added
+*/
+quint64 histogram::sum() const
+{
+	return sumValues;
+}
+
+/**
+* @return largest value added
+*/
+quint64 histogram::max() const
+{
+	return maxValue;
+}
+
+/**
+* @return average of the values added, 0 if there are none
+*/
+double histogram::mean() const
+{
+	return total ? (double)sumValues/total : 0;
+}
+
+/**
+* @param p fraction of the values, in [0,1]
+* @return estimate of the value at p, interpolated linearly within its bucket
+*/
+quint64 histogram::percentile(double p) const
+{
+	if (!total)
+	{
+		return 0;
+	}
+	quint64 rank = (quint64)qCeil(p*total);
+	quint64 seen = 0;
+	for (int i=0; i<HISTOGRAM_BUCKETS; i++)
+	{
+		if (seen + buckets[i] >= rank && buckets[i])
+		{
+			if (!i)
+			{
+				return 0;
+			}
+			//the largest value is a tighter bound for the last bucket used
+			quint64 low = (quint64)1<<(i-1);
+			quint64 high = qMax(low,qMin(((quint64)1<<i) - 1,maxValue));
+			double fraction = (double)(rank - seen)/buckets[i];
+			return low + (quint64)((high - low)*fraction);
+		}
+		seen += buckets[i];
+	}
+	return maxValue;
+}
+
+/**
+* @return the summary as a json object: count, sum, mean, max and percentiles
+*/
+QString histogram::toJson() const
+{
+	return QString("{\"count\":%1,\"sum\":%2,\"mean\":%3,\"max\":%4,\"p50\":%5,\"p90\":%6,\"p99\":%7}")
+		.arg(total).arg(sumValues).arg(mean(),0,'f',1).arg(maxValue)
+		.arg(percentile(0.5)).arg(percentile(0.9)).arg(percentile(0.99));
+}
+
+/**
+* constructor
+*/
+mapMetrics::mapMetrics()
+{
+	reset();
+}
+
+/**
+* Sets everything back to 0
+*/
+void mapMetrics::reset()
+{
+	readTime.reset();
+	decodeTime.reset();
+	blitTime.reset();
+	bufferTime.reset();
+	scrollTime.reset();
+	queueDepth.reset();
+	servers.clear();
+	memHits = 0;
+	memMisses = 0;
+	diskHits = 0;
+	diskMisses = 0;
+	hedges = 0;
+	hedgeWins = 0;
+	frames = 0;
+	placeholderFrames = 0;
+	since.start();
+}
+
+/**
+* @return hits/(hits+misses) as json, null if there were no lookups
+*/
+QString mapMetrics::ratio(quint64 hits, quint64 misses)
+{
+	if (!(hits + misses))
+	{
+		return "null";
+	}
+	return QString::number((double)hits/(hits+misses),'f',4);
+}
+
+/**
+* @return every metric as a json object, times in us
+*/
+QString mapMetrics::toJson() const
+{
+	QString json;
+	QTextStream out(&json);
+	out<<"{\"elapsed_ms\":"<<since.elapsed()
+		<<",\"read_us\":"<<readTime.toJson()
+		<<",\"decode_us\":"<<decodeTime.toJson()
+		<<",\"blit_us\":"<<blitTime.toJson()
+		<<",\"update_buffer_us\":"<<bufferTime.toJson()
+		<<",\"scroll_buffer_us\":"<<scrollTime.toJson()
+		<<",\"queue_depth\":"<<queueDepth.toJson()
+		<<",\"mem_cache\":{\"hits\":"<<memHits<<",\"misses\":"<<memMisses<<",\"ratio\":"<<ratio(memHits,memMisses)<<"}"
+		<<",\"disk_cache\":{\"hits\":"<<diskHits<<",\"misses\":"<<diskMisses<<",\"ratio\":"<<ratio(diskHits,diskMisses)<<"}"
+		<<",\"hedges\":{\"sent\":"<<hedges<<",\"won\":"<<hedgeWins<<"}"
+		<<",\"frames\":"<<frames
+		<<",\"placeholder_frames\":"<<placeholderFrames
+		<<",\"servers\":{";
+	QHash<QString,serverMetrics>::const_iterator i;
+	for (i = servers.constBegin(); i != servers.constEnd(); ++i)
+	{
+		if (i != servers.constBegin())
+		{
+			out<<",";
+		}
+		//server names come from the config file, only quotes and backslashes need escaping
+		QString name = i.key();
+		name.replace("\\","\\\\").replace("\"","\\\"");
+		serverMetrics const & s = i.value();
+		out<<"\""<<name<<"\":{\"requests\":"<<s.requests<<",\"bytes\":"<<s.bytes
+			<<",\"not_modified\":"<<s.notModified<<",\"not_found\":"<<s.notFound
+			<<",\"errors\":"<<s.errors<<",\"latency_us\":"<<s.latency.toJson()<<"}";
+	}
+	out<<"}}";
+	out.flush();
+	return json;
+}
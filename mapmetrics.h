@@ -0,0 +1,99 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef MAPMETRICS_H
+#define MAPMETRICS_H
+
+#include <QtCore>
+
+/**
+* number of buckets of a histogram, the last one takes everything from 2^(HISTOGRAM_BUCKETS-2) up
+*/
+#define HISTOGRAM_BUCKETS 32
+
+/**
+* Histogram with power of two buckets
+* Bucket 0 counts zeros and bucket i counts values in [2^(i-1), 2^i).
+* Adding a value is a few instructions, so it can be left on everywhere.
+*/
+class histogram
+{
+public:
+	histogram();
+	void add(quint64);
+	void reset();
+	void decay();
+	quint64 count() const;
+	quint64 sum() const;
+	quint64 max() const;
+	double mean() const;
+	quint64 percentile(double) const;
+	QString toJson() const;
+
+private:
+	quint64 buckets[HISTOGRAM_BUCKETS];
+	quint64 total;/**< number of values added. */
+	quint64 sumValues;/**< sum of the values added. */
+	quint64 maxValue;/**< largest value added. */
+};
+
+/**
+* Network numbers of a tile server
+*/
+struct serverMetrics
+{
+	histogram latency;/**< us from sending a request to its last byte. */
+	quint64 requests;/**< requests that finished, aborted ones excluded. */
+	quint64 bytes;/**< bytes of %tile data received. */
+	quint64 notModified;/**< revalidations answered with 304. */
+	quint64 notFound;/**< requests answered with 404. */
+	quint64 errors;/**< requests that failed for any other reason. */
+	serverMetrics():requests(0),bytes(0),notModified(0),notFound(0),errors(0){}
+};
+
+/**
+* Counters and histograms of where cacaMap spends its time
+* Times are in us. Only used from the GUI thread.
+* @see cacaMap::getMetrics()
+*/
+class mapMetrics
+{
+public:
+	mapMetrics();
+	void reset();
+	QString toJson() const;
+
+	histogram readTime;/**< reading a %tile file, in a worker thread. */
+	histogram decodeTime;/**< decoding a %tile image, in a worker thread. */
+	histogram blitTime;/**< drawing a %tile (or its placeholder) into the buffer. */
+	histogram bufferTime;/**< full redraws of the buffer, see cacaMap::updateBuffer(). */
+	histogram scrollTime;/**< pans of the buffer, see cacaMap::scrollBuffer(). */
+	histogram queueDepth;/**< tiles queued or downloading, sampled whenever downloads are started. */
+	QHash<QString,serverMetrics> servers;/**< network numbers by server name. */
+	quint64 memHits;/**< %tile lookups (visible tiles and their ancestors) served decoded from RAM. */
+	quint64 memMisses;/**< %tile lookups that had to read and decode the %tile. */
+	quint64 diskHits;/**< visible tiles found in the HDD cache. */
+	quint64 diskMisses;/**< visible tiles that weren't cached and had to be downloaded or put together. */
+	quint64 hedges;/**< duplicate requests sent to a mirror because the first was slow. */
+	quint64 hedgeWins;/**< hedged requests that answered first. */
+	quint64 frames;/**< frames painted. */
+	quint64 placeholderFrames;/**< frames painted with at least one placeholder in view. */
+	QElapsedTimer since;/**< time since the last reset. */
+
+private:
+	static QString ratio(quint64, quint64);
+};
+
+#endif
@@ -0,0 +1,120 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "mercator.h"
+#include <cmath>
+
+/**
+* constructor
+*/
+longPoint::longPoint(qint64 _x, qint64 _y)
+{
+	x = _x;
+	y = _y;
+}
+/**
+*empty constructor
+*/
+
+longPoint::longPoint()
+{
+	x = 0;
+	y = 0;
+}
+
+/**
+* Converts a geo coordinate to map pixels
+* @param geocoord has the longitude and latitude in degrees.
+* @param zoom is the zoom level, ranges from cacaMap::minZoom (out) to maxZoom (in).
+* @param tilesize the width/height in px of the square %tile (e.g 256).
+* @return a longpoint struct containing the x and y px coordinates
+* in the map for the given geocoordinates and zoom level.
+*/
+longPoint myMercator::geoCoordToPixel(QPointF const &geocoord, int zoom, int tilesize)
+{
+	qreal lon = geocoord.x();
+	qreal lat = geocoord.y();
+	longPoint p;
+	geoCoordToPixel(&lon,&lat,&p.x,&p.y,1,zoom,tilesize);
+	return p;
+}
+/**
+* Converts  map pixels to geo coordinates in degrees
+* @param pixelcoord has the x and y px coordinates.
+* @param zoom  is the zoom level, ranges from 0(out) to 18(in).
+* @param tilesize the width/height in px of the square %tile (e.g 256).
+* @return a QPointF object containing the latitude and longitude of 
+* of the given location.
+*/
+
+QPointF myMercator::pixelToGeoCoord(longPoint const &pixelcoord, int zoom, int tilesize)
+{
+	qreal lon, lat;
+	pixelToGeoCoord(&pixelcoord.x,&pixelcoord.y,&lon,&lat,1,zoom,tilesize);
+	return QPointF(lon,lat);
+}
+
+/**
+* Converts an array of geo coordinates to map pixels
+* @param lon longitudes in degrees
+* @param lat latitudes in degrees, clamped to +-MERCATOR_MAX_LAT
+* @param x gets the x px coordinates
+* @param y gets the y px coordinates
+* @param count number of points, every array must have room for them
+* @param zoom zoom level
+* @param tilesize the width/height in px of the square %tile (e.g 256).
+*/
+void myMercator::geoCoordToPixel(qreal const * lon, qreal const * lat, qint64 * x, qint64 * y, int count, int zoom, int tilesize)
+{
+	//height, width of the whole map,this is, all tiles for a given zoom level put together
+	qreal mapsize = (qreal)((qint64)tilesize<<zoom);
+	qreal scale = mapsize/360.0;
+	qreal toRad = M_PI/180.0;
+	qreal ymerc = mapsize/(2*M_PI);
+	for (int i=0; i<count; i++)
+	{
+		//atanh(sin(lat)), the poles would give inf so they are clamped to the map edge
+		qreal s = sin(qBound((qreal)-MERCATOR_MAX_LAT,lat[i],(qreal)MERCATOR_MAX_LAT)*toRad);
+		qreal latitude_m = 0.5*log((1 + s)/(1 - s));
+		x[i] = (qint64)((lon[i] + 180.0)*scale);
+		y[i] = (qint64)(mapsize/2 - latitude_m*ymerc);
+	}
+}
+
+/**
+* Converts an array of map pixels to geo coordinates in degrees
+* @param x x px coordinates
+* @param y y px coordinates
+* @param lon gets the longitudes
+* @param lat gets the latitudes
+* @param count number of points, every array must have room for them
+* @param zoom zoom level
+* @param tilesize the width/height in px of the square %tile (e.g 256).
+*/
+void myMercator::pixelToGeoCoord(qint64 const * x, qint64 const * y, qreal * lon, qreal * lat, int count, int zoom, int tilesize)
+{
+	//height, width of the whole map,this is, all tiles for a given zoom level put together
+	qreal mapsize = (qreal)((qint64)tilesize<<zoom);
+	qreal scale = 360.0/mapsize;
+	qreal toMerc = 2*M_PI/mapsize;
+	qreal toDeg = 180.0/M_PI;
+	for (int i=0; i<count; i++)
+	{
+		lon[i] = x[i]*scale - 180.0;
+		//asin(tanh(m)) is the gudermannian, 2*atan(exp(m)) - pi/2
+		qreal latitude_m = M_PI - y[i]*toMerc;
+		lat[i] = (2*atan(exp(latitude_m)) - M_PI/2)*toDeg;
+	}
+}
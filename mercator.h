@@ -0,0 +1,52 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef MERCATOR_H
+#define MERCATOR_H
+
+#include <QtCore>
+
+/**
+* The 64 bit integer version of QPoint
+* Map px coords at zoom z go up to 2^z*tilesize, which doesn't fit in 32 bits past level 23.
+*/
+
+struct longPoint
+{
+	qint64 x;/**< x coord. */
+	qint64 y;/**< y coord.*/
+	longPoint(qint64,qint64);
+	longPoint();
+};
+
+/**
+* latitude in degrees where the square mercator map ends, points beyond it are clamped
+*/
+#define MERCATOR_MAX_LAT 85.05112878
+
+/**
+Helper struct that handles coordinate transformations
+The batch versions take and fill arrays of coordinates (struct of arrays),
+so projecting many points pays the setup and the call once.
+*/
+struct myMercator
+{
+	static longPoint geoCoordToPixel(QPointF const &,int , int);
+	static QPointF pixelToGeoCoord(longPoint const &, int, int);
+	static void geoCoordToPixel(qreal const *, qreal const *, qint64 *, qint64 *, int, int, int);
+	static void pixelToGeoCoord(qint64 const *, qint64 const *, qreal *, qreal *, int, int, int);
+};
+
+#endif
@@ -0,0 +1,226 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "metastore.h"
+#include <iostream>
+using namespace std;
+
+/**
+* kinds of records in the log
+*/
+enum metaRecordKind
+{
+	META_REMOVED,/**< the %tile was deleted, forget about it. */
+	META_TILE,/**< metadata of a cached %tile. */
+	META_NOT_FOUND/**< the server returned 404 for the %tile. */
+};
+
+/**
+* constructor
+* @param _dir cache folder of the server, the log is kept inside it
+*/
+metaStore::metaStore(QString const & _dir)
+{
+	dir = _dir;
+	file.setFileName(dir+"/"+META_FILE);
+}
+
+/**
+* destructor
+*/
+metaStore::~metaStore()
+{
+	close();
+}
+
+/**
+* Reads the log
+* @param metas gets the metadata of each %tile
+* @param time current time_t, 404s that expired before it are dropped
+*/
+void metaStore::load(QHash<tileKey,tileMeta> & metas, quint32 time)
+{
+	QMutexLocker locker(&mutex);
+	metas.clear();
+	if (file.isOpen())
+	{
+		file.close();
+	}
+	QDir().mkpath(dir);
+	if (!file.open(QIODevice::ReadWrite))
+	{
+		cout<<"couldn't open tile metadata "<<file.fileName().toStdString()<<endl;
+		return;
+	}
+	QDataStream in(&file);
+	quint32 magic = 0, version = 0;
+	in>>magic>>version;
+	if (magic != META_MAGIC || version != META_VERSION)
+	{
+		rewrite(metas);
+		return;
+	}
+	qint64 records = 0;
+	qint64 good = file.pos();
+	while (!in.atEnd())
+	{
+		quint64 id;
+		quint8 kind;
+		tileMeta meta;
+		in>>id>>kind>>meta.expires>>meta.etag>>meta.lastModified;
+		//a torn record at the end, the rest of the file is garbage
+		if (in.status() != QDataStream::Ok)
+		{
+			break;
+		}
+		good = file.pos();
+		records++;
+		tileKey key;
+		key.id = id;
+		if (kind == META_REMOVED || (kind == META_NOT_FOUND && meta.expires <= time))
+		{
+			metas.remove(key);
+			continue;
+		}
+		meta.notFound = kind == META_NOT_FOUND;
+		metas.insert(key,meta);
+	}
+	//dont let overridden records pile up forever
+	if (records > 2*(qint64)metas.size() + 1000 || good != file.size())
+	{
+		rewrite(metas);
+	}
+	else
+	{
+		file.seek(file.size());
+	}
+}
+
+/**
+* Records the metadata of a %tile, or a 404 if meta.notFound is set
+*/
+void metaStore::set(tileKey key, tileMeta const & meta)
+{
+	QMutexLocker locker(&mutex);
+	writeRecord(key,meta.notFound ? META_NOT_FOUND : META_TILE,meta);
+}
+
+/**
+* Records that a %tile was deleted
+*/
+void metaStore::remove(tileKey key)
+{
+	QMutexLocker locker(&mutex);
+	writeRecord(key,META_REMOVED,tileMeta());
+}
+
+/**
+* Flushes pending records and closes the log
+*/
+void metaStore::close()
+{
+	QMutexLocker locker(&mutex);
+	if (file.isOpen())
+	{
+		file.close();
+	}
+}
+
+/**
+* Extracts the caching information of a response
+* @param reply a finished request, either a %tile, a 304 or a 404
+* @param time current time_t
+*/
+tileMeta metaStore::fromReply(QNetworkReply * reply, quint32 time)
+{
+	tileMeta meta;
+	meta.notFound = reply->error() == QNetworkReply::ContentNotFoundError;
+	meta.etag = reply->rawHeader("ETag");
+	meta.lastModified = reply->rawHeader("Last-Modified");
+	qint64 maxAge = meta.notFound ? META_NOT_FOUND_TTL : META_DEFAULT_MAX_AGE;
+	QList<QByteArray> directives = reply->rawHeader("Cache-Control").split(',');
+	for (int i=0; i<directives.size(); i++)
+	{
+		QByteArray directive = directives.at(i).trimmed().toLower();
+		if (directive.startsWith("max-age="))
+		{
+			bool ok;
+			qint64 seconds = directive.mid(8).toLongLong(&ok);
+			if (ok && seconds >= 0)
+			{
+				maxAge = seconds;
+			}
+		}
+		else if (directive == "no-cache" || directive == "no-store")
+		{
+			maxAge = 0;
+		}
+	}
+	maxAge = qMax(maxAge,(qint64)META_MIN_MAX_AGE);
+	meta.expires = (quint32)qMin((qint64)time + maxAge,(qint64)0xffffffff);
+	return meta;
+}
+
+/**
+* @return current time as a time_t, the unit tileMeta::expires is in
+*/
+quint32 metaStore::now()
+{
+	return QDateTime::currentDateTime().toTime_t();
+}
+
+/**
+* Replaces the log with one record per %tile, the mutex must be held
+*/
+void metaStore::rewrite(QHash<tileKey,tileMeta> const & metas)
+{
+	if (file.isOpen())
+	{
+		file.close();
+	}
+	if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate))
+	{
+		cout<<"couldn't open tile metadata "<<file.fileName().toStdString()<<endl;
+		return;
+	}
+	QDataStream out(&file);
+	out<<(quint32)META_MAGIC<<(quint32)META_VERSION;
+	QHash<tileKey,tileMeta>::const_iterator i;
+	for (i = metas.constBegin(); i != metas.constEnd(); ++i)
+	{
+		writeRecord(i.key(),i.value().notFound ? META_NOT_FOUND : META_TILE,i.value());
+	}
+	file.flush();
+}
+
+/**
+* Appends a record at the end of the log
+* The log is reopened if needed, e.g. for replies of a server that is no longer selected.
+* The mutex must be held.
+*/
+bool metaStore::writeRecord(tileKey key, quint8 kind, tileMeta const & meta)
+{
+	if (!file.isOpen())
+	{
+		if (!file.exists() || !file.open(QIODevice::ReadWrite))
+		{
+			return false;
+		}
+		file.seek(file.size());
+	}
+	QDataStream out(&file);
+	out<<(quint64)key.id<<kind<<meta.expires<<meta.etag<<meta.lastModified;
+	return out.status() == QDataStream::Ok;
+}
@@ -0,0 +1,84 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef METASTORE_H
+#define METASTORE_H
+
+#include <QtCore>
+#include <QtNetwork>
+#include "tilekey.h"
+
+#define META_MAGIC 0x544d4d43 //"CMMT"
+#define META_VERSION 1
+#define META_FILE "meta.dat"
+/**
+* seconds a %tile is fresh for when the server doesn't send a max-age
+*/
+#define META_DEFAULT_MAX_AGE 7*24*3600
+/**
+* seconds a 404 is remembered for when the server doesn't send a max-age
+*/
+#define META_NOT_FOUND_TTL 24*3600
+/**
+* fewest seconds a %tile or a 404 is trusted for, even if the server asks for no caching,
+* otherwise it would be revalidated every time it's shown
+*/
+#define META_MIN_MAX_AGE 60
+/**
+* seconds before a %tile whose revalidation failed is tried again
+*/
+#define META_RETRY 3600
+
+/**
+* HTTP caching information of a %tile
+*/
+struct tileMeta
+{
+	QByteArray etag;/**< ETag of the %tile, sent back in If-None-Match. */
+	QByteArray lastModified;/**< Last-Modified of the %tile, sent back in If-Modified-Since. */
+	quint32 expires;/**< time_t after which the %tile has to be revalidated, or the 404 forgotten. */
+	bool notFound;/**< the server doesn't have the %tile. */
+	tileMeta():expires(0),notFound(false){}
+};
+
+/**
+* Persistent HTTP metadata of the tiles of a server, kept next to its cache
+* It's an append only log of records, later records for the same %tile override
+* earlier ones. The log is rewritten when it's mostly overridden records. Records
+* are buffered, so the last few can be lost in a crash, which only makes those
+* tiles look stale. Thread safe.
+*/
+class metaStore
+{
+public:
+	metaStore(QString const &);
+	~metaStore();
+	void load(QHash<tileKey,tileMeta> &, quint32);
+	void set(tileKey, tileMeta const &);
+	void remove(tileKey);
+	void close();
+	static tileMeta fromReply(QNetworkReply *, quint32);
+	static quint32 now();
+
+private:
+	void rewrite(QHash<tileKey,tileMeta> const &);
+	bool writeRecord(tileKey, quint8, tileMeta const &);
+
+	QMutex mutex;/**< guards file. */
+	QString dir;/**< cache folder of the server. */
+	QFile file;/**< the log, open while the folder is in use. */
+};
+
+#endif
@@ -5,8 +5,9 @@ myDerivedMap::myDerivedMap(QWidget* parent):cacaMap(parent)
 {
 	cout<<"derived constructor"<<endl;
 	timer = new QTimer(this);
-	mindistance = 0.025;
+	mindistance = 0.05;
 	animrate = 0.5;	
+	destinationZoom = zoom;
 	
 	hlayout = new QHBoxLayout;
 
@@ -16,6 +17,14 @@ myDerivedMap::myDerivedMap(QWidget* parent):cacaMap(parent)
 	slider->setMinimum(minZoom);
 	slider->setSliderPosition(zoom);
 	connect(slider, SIGNAL(valueChanged(int)),this, SLOT(updateZoom(int)));
+	connect(slider, SIGNAL(sliderReleased()),this, SLOT(applyZoom()));
+	//a server change can change the deepest level
+	connect(this, SIGNAL(serverChanged()),this, SLOT(updateSlider()));
+	sliderZoom = zoom;
+	zoomDebounce = new QTimer(this);
+	zoomDebounce->setSingleShot(true);
+	zoomDebounce->setInterval(ZOOM_DEBOUNCE);
+	connect(zoomDebounce,SIGNAL(timeout()),this,SLOT(applyZoom()));
 	
 	hlayout->addWidget(slider);
 	hlayout->addStretch();
@@ -37,23 +46,51 @@ This is used for scrolling the map
 void myDerivedMap::mousePressEvent(QMouseEvent* e)
 {
 	mouseAnchor = e->pos();
+	panVelocity = QPointF();
+	sampleDelta = QPointF();
+	moveClock.start();
 }
 
 /**
 Calculates the length of the mouse drag and
-translates it into a new coordinate, map is rerendered
+translates it into a new coordinate, map is rerendered.
+The tiles the drag is heading to are prefetched.
 */
 void myDerivedMap::mouseMoveEvent(QMouseEvent* e)
 {
-	QPoint delta = e->pos()- mouseAnchor;
+	//between levels the map is magnified, so the mouse moves further than the map
+	QPointF delta = QPointF(e->pos()- mouseAnchor)/pow(2.0,fractionalZoom - zoom);
 	mouseAnchor = e->pos();
 	longPoint p = myMercator::geoCoordToPixel(geocoords,zoom,tileSize);
 	
-	p.x-= delta.x();
-	p.y-= delta.y();
+	p.x-= qRound(delta.x());
+	p.y-= qRound(delta.y());
 	geocoords = myMercator::pixelToGeoCoord(p,zoom,tileSize);
-	updateContent();
-	update();
+	//moves are coalesced, the map is redrawn once per frame
+	scheduleUpdate();
+
+	//moves within the same ms count together in the next sample
+	sampleDelta += delta;
+	qint64 dt = moveClock.elapsed();
+	if (dt == 0)
+	{
+		return;
+	}
+	moveClock.restart();
+	//the view moves against the mouse, average out the jitter of single events
+	QPointF moved = sampleDelta;
+	sampleDelta = QPointF();
+	if (dt < 200)
+	{
+		QPointF current = -moved*1000.0/dt;
+		panVelocity = 0.7*panVelocity + 0.3*current;
+		prefetchPan(panVelocity);
+	}
+	else
+	{
+		//the drag stalled, start over
+		panVelocity = QPointF();
+	}
 }
 
 void myDerivedMap::mouseDoubleClickEvent(QMouseEvent* e)
@@ -61,12 +98,19 @@ void myDerivedMap::mouseDoubleClickEvent(QMouseEvent* e)
 	//do the zoom-in animation magic
 	if (e->button() == Qt::LeftButton)
 	{
-		QPoint deltapx = e->pos() - QPoint(width()/2,height()/2);
+		if (timer->isActive() || zoom >= maxZoom)
+		{
+			return;
+		}
+		QPointF deltapx = QPointF(e->pos() - QPoint(width()/2,height()/2))/pow(2.0,fractionalZoom - zoom);
 		longPoint currpospx = myMercator::geoCoordToPixel(geocoords,zoom,tileSize);
 		longPoint newpospx;
-		newpospx.x = currpospx.x + deltapx.x();
-		newpospx.y = currpospx.y + deltapx.y();
+		newpospx.x = currpospx.x + qRound(deltapx.x());
+		newpospx.y = currpospx.y + qRound(deltapx.y());
 		destination = myMercator::pixelToGeoCoord(newpospx,zoom,tileSize);
+		destinationZoom = zoom+1;
+		//get the tiles of the next level while the animation runs
+		prefetchZoom(destination,destinationZoom);
 		connect(timer,SIGNAL(timeout()),this,SLOT(zoomAnim()));
 		timer->start(40);
 	}
@@ -74,20 +118,18 @@ void myDerivedMap::mouseDoubleClickEvent(QMouseEvent* e)
 	else if (e->button() == Qt::RightButton)
 	{
 		zoomOut();
-		slider->setSliderPosition(zoom);
-		update();
+		updateSlider();
 	}
 }
 
 void myDerivedMap::zoomAnim()
 {
-	float delta = buffzoomrate - 0.5;
+	double delta = destinationZoom - getFractionalZoom();
 	if (delta > mindistance)
 	{
 		QPointF deltaSpace = destination - geocoords;
 		geocoords+=animrate*deltaSpace;
-		buffzoomrate-= delta*animrate; 
-		updateContent();
+		setZoom(getFractionalZoom() + delta*animrate);
 	}
 	//you are already there
 	else
@@ -95,16 +137,52 @@ void myDerivedMap::zoomAnim()
 		timer->stop();
 		disconnect(timer,SIGNAL(timeout()),this,SLOT(zoomAnim()));
 		geocoords = destination;
-		buffzoomrate = 1.0;
-		zoomIn();
-		slider->setSliderPosition(zoom);
+		setZoom(destinationZoom);
+		updateSlider();
+	}
+}
+
+/**
+Zooms in or out a quarter of a level per wheel step, around the center of the map
+*/
+void myDerivedMap::wheelEvent(QWheelEvent* e)
+{
+	if (timer->isActive())
+	{
+		return;
 	}
-	update();
+	double level = qBound((double)minZoom,getFractionalZoom() + e->delta()/120.0/4,(double)maxZoom);
+	setZoom(level);
+	updateSlider();
+}
+
+/**
+Moves the slider to the current zoom level without zooming again
+*/
+void myDerivedMap::updateSlider()
+{
+	slider->blockSignals(true);
+	//the range depends on the server
+	slider->setRange(minZoom,maxZoom);
+	slider->setSliderPosition(qRound(getFractionalZoom()));
+	slider->blockSignals(false);
 }
+/**
+Dragging the slider goes through many levels quickly, only the one it
+stops at is applied, so the levels in between dont queue any downloads
+*/
 void myDerivedMap::updateZoom(int newZoom)
 {
-	setZoom(newZoom);
-	update();
+	sliderZoom = newZoom;
+	zoomDebounce->start();
+}
+void myDerivedMap::applyZoom()
+{
+	zoomDebounce->stop();
+	if (sliderZoom != getFractionalZoom())
+	{
+		setZoom(sliderZoom);
+	}
 }
 void myDerivedMap::paintEvent(QPaintEvent *e)
 {
@@ -2,6 +2,11 @@
 #define DERIVEDMAP_H
 #include "cacamap.h"
 
+/**
+* ms the slider has to rest on a level before the map zooms to it
+*/
+#define ZOOM_DEBOUNCE 150
+
 class myDerivedMap: public cacaMap
 {
 
@@ -14,18 +19,27 @@ protected:
 	void mousePressEvent(QMouseEvent*);
 	void mouseMoveEvent(QMouseEvent*);
 	void mouseDoubleClickEvent(QMouseEvent*);
+	void wheelEvent(QWheelEvent*);
 private:
 	QPoint mouseAnchor;/**< used to keep track of the last mouse click location.*/
+	QElapsedTimer moveClock;/**< time since the last velocity sample, used to estimate the pan velocity.*/
+	QPointF sampleDelta;/**< px the map moved since the last velocity sample.*/
+	QPointF panVelocity;/**< smoothed speed of the view center in px/s while dragging.*/
 	QTimer * timer;
+	QTimer * zoomDebounce;/**< applies the slider level once it stops changing.*/
+	int sliderZoom;/**< level the slider was last moved to.*/
 	QHBoxLayout * hlayout;
 	
 	QSlider * slider;
 	QPointF destination; /**< used for dblclick+zoom animations */
+	int destinationZoom; /**< zoom level the animation ends at */
 	float mindistance;/**< used to identify the end of the animation*/
 	float animrate; 
 protected slots:
+	void updateSlider();
 	void zoomAnim();
 	void updateZoom(int);
+	void applyZoom();
 };
 #endif
 
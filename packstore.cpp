@@ -0,0 +1,533 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+#include "packstore.h"
+#include <cstring>
+#include <iostream>
+using namespace std;
+
+/**
+* @return bytes taken in a pack file by a %tile of the given size, blobs are 8 byte aligned
+*/
+static quint64 blobSpan(quint32 size)
+{
+	return ((quint64)sizeof(packBlobHeader) + size + 7) & ~(quint64)7;
+}
+
+/**
+* constructor
+* @param _dir folder where the pack files and their index are kept
+*/
+packStore::packStore(QString const & _dir)
+{
+	dir = _dir;
+	indexFile.setFileName(dir+"/"+PACK_INDEX_FILE);
+}
+
+/**
+* destructor
+*/
+packStore::~packStore()
+{
+	close();
+}
+
+/**
+* Opens the pack files and reads the index, or rebuilds it from the pack files
+* if it can't be trusted. Does nothing but list the tiles if it's already open.
+* @param tiles gets the tiles and their sizes
+* @param totalSize gets the sum of the sizes
+* @return true if succesful false otherwise
+*/
+bool packStore::load(QHash<tileKey,cacheEntry> & tiles, quint64 & totalSize)
+{
+	QWriteLocker locker(&lock);
+	if (!indexFile.isOpen())
+	{
+		entries.clear();
+		for (int n=0; n<packs.size(); n++)
+		{
+			closePack(n);
+		}
+		packs.clear();
+		QDir().mkpath(dir);
+		QStringList names = QDir(dir).entryList(QStringList("*.pack"),QDir::Files);
+		for (int i=0; i<names.size(); i++)
+		{
+			bool ok;
+			quint32 n = QFileInfo(names.at(i)).baseName().toUInt(&ok);
+			if (ok)
+			{
+				openPack(n);
+			}
+		}
+		if (loadIndex())
+		{
+			writeHeader(false);
+		}
+		else
+		{
+			cout<<"rebuilding pack index "<<indexFile.fileName().toStdString()<<endl;
+			scanPacks();
+		}
+		//figure out how much of each pack is in use
+		QHash<tileKey,packRecord>::iterator i = entries.begin();
+		while (i != entries.end())
+		{
+			packRecord const & rec = i.value();
+			if ((int)rec.file >= packs.size() || !packs.at(rec.file).file)
+			{
+				i = entries.erase(i);
+				continue;
+			}
+			packFile & p = packs[rec.file];
+			p.used = qMax(p.used,rec.offset + blobSpan(rec.size));
+			//live bytes for now, turned into dead bytes below
+			p.dead += blobSpan(rec.size);
+			++i;
+		}
+		for (int n=0; n<packs.size(); n++)
+		{
+			packs[n].dead = packs.at(n).used - packs.at(n).dead;
+		}
+	}
+	tiles.reserve(entries.size());
+	totalSize = 0;
+	QHash<tileKey,packRecord>::const_iterator i;
+	for (i = entries.constBegin(); i != entries.constEnd(); ++i)
+	{
+		tiles.insert(i.key(),cacheEntry(i.value().size));
+		totalSize += i.value().size;
+	}
+	return indexFile.isOpen();
+}
+
+/**
+* @return unique id of a %tile in this store, used to find it in the writer queue
+* @see tileWriter::pending
+*/
+QString packStore::jobPath(tileKey key)
+{
+	return dir+"/"+QString().setNum(key.id);
+}
+
+/**
+* Decodes a %tile directly from the mapped pack file. Can be called from any thread.
+* @return the image, null if the %tile isn't in the store or can't be decoded
+*/
+QImage packStore::decode(tileKey key)
+{
+	QImage image;
+	QReadLocker locker(&lock);
+	QHash<tileKey,packRecord>::const_iterator i = entries.constFind(key);
+	if (i == entries.constEnd())
+	{
+		return image;
+	}
+	packRecord const & rec = i.value();
+	if ((int)rec.file >= packs.size() || !packs.at(rec.file).map)
+	{
+		return image;
+	}
+	packFile const & p = packs.at(rec.file);
+	//no copy, the data stays in the mapping
+	QByteArray data = QByteArray::fromRawData((char const *)p.map + rec.offset + sizeof(packBlobHeader),rec.size);
+	image.loadFromData(data);
+	return image;
+}
+
+/**
+* Adds a %tile to the store, replacing it if it was there already
+* @return true if succesful false otherwise
+*/
+bool packStore::write(tileKey key, QByteArray const & data)
+{
+	QWriteLocker locker(&lock);
+	return appendBlob(key,data.constData(),data.size());
+}
+
+/**
+* Removes a %tile from the store, its space is reclaimed by compact()
+*/
+void packStore::remove(tileKey key)
+{
+	QWriteLocker locker(&lock);
+	QHash<tileKey,packRecord>::iterator i = entries.find(key);
+	if (i == entries.end())
+	{
+		return;
+	}
+	markDead(i.value());
+	packRecord rec = i.value();
+	rec.size = 0;
+	appendRecord(rec);
+	entries.erase(i);
+}
+
+/**
+* Moves the tiles still in use out of pack files that are mostly dead space
+* and deletes those files. The pack being filled is never compacted.
+*/
+void packStore::compact()
+{
+	QWriteLocker locker(&lock);
+	bool changed = false;
+	int last = packs.size()-1;
+	for (int n=0; n<last; n++)
+	{
+		if (!packs.at(n).file || packs.at(n).dead*2 < packs.at(n).used)
+		{
+			continue;
+		}
+		QList<packRecord> live;
+		QHash<tileKey,packRecord>::const_iterator i;
+		for (i = entries.constBegin(); i != entries.constEnd(); ++i)
+		{
+			if (i.value().file == (quint32)n)
+			{
+				live.append(i.value());
+			}
+		}
+		for (int k=0; k<live.size(); k++)
+		{
+			tileKey key;
+			key.id = live.at(k).key;
+			//the mapping of pack n stays valid even if packs grows
+			char const * data = (char const *)packs.at(n).map + live.at(k).offset + sizeof(packBlobHeader);
+			appendBlob(key,data,live.at(k).size);
+		}
+		closePack(n);
+		QFile::remove(packName(n));
+		changed = true;
+	}
+	if (changed)
+	{
+		//the index is full of stale records by now
+		writeIndex();
+	}
+}
+
+/**
+* Marks the index as trustworthy and closes all the files
+*/
+void packStore::close()
+{
+	QWriteLocker locker(&lock);
+	if (indexFile.isOpen())
+	{
+		writeHeader(true);
+		indexFile.close();
+	}
+	for (int n=0; n<packs.size(); n++)
+	{
+		closePack(n);
+	}
+	packs.clear();
+	entries.clear();
+}
+
+/**
+* @return path of pack file number n
+*/
+QString packStore::packName(quint32 n)
+{
+	return dir+"/"+QString().setNum(n)+".pack";
+}
+
+/**
+* Opens and maps a pack file, creating it if needed. Lock must be held.
+* Files are created with their full size, so they are never remapped.
+*/
+bool packStore::openPack(quint32 n)
+{
+	while (packs.size() <= (int)n)
+	{
+		packFile p;
+		p.file = 0;
+		p.map = 0;
+		p.used = 0;
+		p.dead = 0;
+		packs.append(p);
+	}
+	QFile * f = new QFile(packName(n));
+	if (!f->open(QIODevice::ReadWrite))
+	{
+		cout<<"couldn't open pack file "<<f->fileName().toStdString()<<endl;
+		delete f;
+		return false;
+	}
+	if (f->size() < PACK_SIZE && !f->resize(PACK_SIZE))
+	{
+		cout<<"couldn't resize pack file "<<f->fileName().toStdString()<<endl;
+		delete f;
+		return false;
+	}
+	uchar * map = f->map(0,PACK_SIZE);
+	if (!map)
+	{
+		cout<<"couldn't map pack file "<<f->fileName().toStdString()<<endl;
+		delete f;
+		return false;
+	}
+	packs[n].file = f;
+	packs[n].map = map;
+	packs[n].used = 0;
+	packs[n].dead = 0;
+	return true;
+}
+
+/**
+* Unmaps and closes pack file n. Lock must be held.
+*/
+void packStore::closePack(quint32 n)
+{
+	packFile & p = packs[n];
+	if (p.file)
+	{
+		p.file->unmap(p.map);
+		p.file->close();
+		delete p.file;
+		p.file = 0;
+		p.map = 0;
+	}
+}
+
+/**
+* Copies a %tile at the end of the last pack file, or a new one if it's full. Lock must be held.
+* @return true if succesful false otherwise
+*/
+bool packStore::appendBlob(tileKey key, char const * data, quint32 size)
+{
+	quint64 span = blobSpan(size);
+	if (span > PACK_SIZE)
+	{
+		return false;
+	}
+	int cur = packs.size()-1;
+	if (cur < 0 || !packs.at(cur).file || packs.at(cur).used + span > PACK_SIZE)
+	{
+		cur = packs.size();
+		if (!openPack(cur))
+		{
+			return false;
+		}
+	}
+	packFile & p = packs[cur];
+	packBlobHeader header;
+	header.magic = PACK_MAGIC;
+	header.size = size;
+	header.key = key.id;
+	memcpy(p.map + p.used,&header,sizeof(header));
+	memcpy(p.map + p.used + sizeof(header),data,size);
+
+	packRecord rec;
+	rec.key = key.id;
+	rec.file = cur;
+	rec.size = size;
+	rec.offset = p.used;
+	p.used += span;
+
+	QHash<tileKey,packRecord>::iterator old = entries.find(key);
+	if (old != entries.end())
+	{
+		markDead(old.value());
+	}
+	entries.insert(key,rec);
+	appendRecord(rec);
+	return true;
+}
+
+/**
+* Flags the blob of a removed or replaced %tile as dead. Lock must be held.
+*/
+void packStore::markDead(packRecord const & rec)
+{
+	packFile & p = packs[rec.file];
+	if (p.map)
+	{
+		quint32 magic = PACK_DEAD;
+		memcpy(p.map + rec.offset,&magic,sizeof(magic));
+		p.dead += blobSpan(rec.size);
+	}
+}
+
+/**
+* Reads the index file into entries. Lock must be held.
+* Every %tile has to point inside an open pack file, at a live blob with its key and size.
+* @return false if it's missing, wasn't closed properly or is damaged
+*/
+bool packStore::loadIndex()
+{
+	if (!indexFile.open(QIODevice::ReadWrite))
+	{
+		return false;
+	}
+	qint64 size = indexFile.size();
+	if (size < (qint64)sizeof(indexHeader))
+	{
+		return false;
+	}
+	uchar * map = indexFile.map(0,size);
+	if (!map)
+	{
+		return false;
+	}
+	indexHeader const * header = (indexHeader const *)map;
+	if (header->magic != PACK_INDEX_MAGIC || header->version != PACK_INDEX_VERSION || !header->clean)
+	{
+		indexFile.unmap(map);
+		return false;
+	}
+	qint64 count = (size - sizeof(indexHeader))/sizeof(packRecord);
+	packRecord const * records = (packRecord const *)(map + sizeof(indexHeader));
+	entries.reserve((int)count);
+	bool valid = true;
+	for (qint64 i=0; i<count && valid; i++)
+	{
+		packRecord const & rec = records[i];
+		tileKey key;
+		key.id = rec.key;
+		if (rec.size)
+		{
+			//the blob would be read from the mapping as it is, so it has to fit in it
+			valid = (int)rec.file < packs.size() && packs.at(rec.file).map
+				&& rec.offset <= PACK_SIZE - sizeof(packBlobHeader)
+				&& rec.size <= PACK_SIZE - sizeof(packBlobHeader) - rec.offset;
+			entries.insert(key,rec);
+		}
+		else
+		{
+			entries.remove(key);
+		}
+	}
+	indexFile.unmap(map);
+	//earlier records of a %tile point to dead blobs, so only the last ones are checked
+	QHash<tileKey,packRecord>::const_iterator e;
+	for (e = entries.constBegin(); e != entries.constEnd() && valid; ++e)
+	{
+		packBlobHeader header;
+		memcpy(&header,packs.at(e.value().file).map + e.value().offset,sizeof(header));
+		valid = header.magic == PACK_MAGIC && header.key == e.value().key && header.size == e.value().size;
+	}
+	if (!valid)
+	{
+		cout<<"pack index "<<indexFile.fileName().toStdString()<<" is damaged"<<endl;
+		entries.clear();
+	}
+	return valid;
+}
+
+/**
+* Rebuilds entries by walking the blobs of every pack file, and rewrites the index.
+* Lock must be held.
+*/
+void packStore::scanPacks()
+{
+	entries.clear();
+	for (int n=0; n<packs.size(); n++)
+	{
+		if (!packs.at(n).file)
+		{
+			continue;
+		}
+		uchar const * map = packs.at(n).map;
+		quint64 offset = 0;
+		while (offset + sizeof(packBlobHeader) <= PACK_SIZE)
+		{
+			packBlobHeader header;
+			memcpy(&header,map + offset,sizeof(header));
+			if ((header.magic != PACK_MAGIC && header.magic != PACK_DEAD)
+				|| header.size > PACK_SIZE - offset - sizeof(header))
+			{
+				//end of the used part
+				break;
+			}
+			if (header.magic == PACK_MAGIC)
+			{
+				packRecord rec;
+				rec.key = header.key;
+				rec.file = n;
+				rec.size = header.size;
+				rec.offset = offset;
+				tileKey key;
+				key.id = header.key;
+				entries.insert(key,rec);
+			}
+			offset += blobSpan(header.size);
+		}
+	}
+	writeIndex();
+}
+
+/**
+* Rewrites the index file from entries, marked as in use. Lock must be held.
+*/
+void packStore::writeIndex()
+{
+	if (indexFile.isOpen())
+	{
+		indexFile.close();
+	}
+	if (!indexFile.open(QIODevice::ReadWrite | QIODevice::Truncate))
+	{
+		cout<<"couldn't open pack index "<<indexFile.fileName().toStdString()<<endl;
+		return;
+	}
+	indexHeader header;
+	header.magic = PACK_INDEX_MAGIC;
+	header.version = PACK_INDEX_VERSION;
+	header.clean = 0;
+	header.reserved = 0;
+	header.signature = 0;
+	QByteArray buffer;
+	buffer.reserve(sizeof(indexHeader) + entries.size()*sizeof(packRecord));
+	buffer.append((char const *)&header,sizeof(header));
+	QHash<tileKey,packRecord>::const_iterator i;
+	for (i = entries.constBegin(); i != entries.constEnd(); ++i)
+	{
+		buffer.append((char const *)&i.value(),sizeof(packRecord));
+	}
+	indexFile.write(buffer);
+	indexFile.flush();
+}
+
+/**
+* Updates the clean flag of the index header. Lock must be held.
+*/
+void packStore::writeHeader(bool clean)
+{
+	indexHeader header;
+	header.magic = PACK_INDEX_MAGIC;
+	header.version = PACK_INDEX_VERSION;
+	header.clean = clean;
+	header.reserved = 0;
+	header.signature = 0;
+	if (indexFile.isOpen() && indexFile.seek(0))
+	{
+		indexFile.write((char const *)&header,sizeof(header));
+		indexFile.flush();
+	}
+}
+
+/**
+* Appends a record at the end of the index file. Lock must be held.
+*/
+void packStore::appendRecord(packRecord const & rec)
+{
+	if (indexFile.isOpen() && indexFile.seek(indexFile.size()))
+	{
+		indexFile.write((char const *)&rec,sizeof(rec));
+		indexFile.flush();
+	}
+}
@@ -0,0 +1,105 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef PACKSTORE_H
+#define PACKSTORE_H
+
+#include <QtGui>
+#include "tilekey.h"
+#include "cacheindex.h"
+
+/**
+* size of each pack file, they are created with this size and filled up
+*/
+#define PACK_SIZE 64*1024*1024 //64MB
+#define PACK_MAGIC 0x42544d43 //"CMTB"
+#define PACK_DEAD 0x44544d43 //"CMTD"
+#define PACK_INDEX_MAGIC 0x58504d43 //"CMPX"
+#define PACK_INDEX_VERSION 1
+#define PACK_INDEX_FILE "pack.idx"
+
+/**
+* Header in front of every %tile in a pack file
+*/
+struct packBlobHeader
+{
+	quint32 magic;/**< PACK_MAGIC, or PACK_DEAD once the %tile is removed or replaced. */
+	quint32 size;/**< size in bytes of the data that follows. */
+	quint64 key;/**< packed tileKey. */
+};
+
+/**
+* Location of a %tile, also the record format of the pack index file
+*/
+struct packRecord
+{
+	quint64 key;/**< packed tileKey. */
+	quint32 file;/**< number of the pack file. */
+	quint32 size;/**< size of the %tile data, 0 if it was removed. */
+	quint64 offset;/**< offset of the blob header in the pack file. */
+};
+
+/**
+* An open pack file
+*/
+struct packFile
+{
+	QFile * file;/**< 0 if this pack number doesn't exist (e.g. it was compacted). */
+	uchar * map;/**< the whole file mapped in memory. */
+	quint64 used;/**< bytes used from the beginning of the file. */
+	quint64 dead;/**< bytes used by removed or replaced tiles. */
+};
+
+/**
+* Storage backend that appends tiles to a few big pack files instead of
+* using one file per %tile. Pack files are mapped in memory, so tiles are
+* decoded straight from the mapping without copying them.
+* Where each %tile is lives in an index file that is appended to, like cacheIndex.
+* Pack files that are mostly made of removed tiles are compacted.
+* Reads are thread safe, writes must all come from the same thread.
+*/
+class packStore
+{
+public:
+	packStore(QString const &);
+	~packStore();
+	bool load(QHash<tileKey,cacheEntry> &, quint64 &);
+	QString jobPath(tileKey);
+	QImage decode(tileKey);
+	bool write(tileKey, QByteArray const &);
+	void remove(tileKey);
+	void compact();
+	void close();
+
+private:
+	QString packName(quint32);
+	bool openPack(quint32);
+	void closePack(quint32);
+	bool appendBlob(tileKey, char const *, quint32);
+	void markDead(packRecord const &);
+	bool loadIndex();
+	void scanPacks();
+	void writeIndex();
+	void writeHeader(bool);
+	void appendRecord(packRecord const &);
+
+	QReadWriteLock lock;/**< guards everything below. */
+	QString dir;/**< folder with the pack files. */
+	QHash<tileKey,packRecord> entries;/**< where each %tile is. */
+	QVector<packFile> packs;/**< pack files, by number. */
+	QFile indexFile;/**< the pack index. */
+};
+
+#endif
@@ -0,0 +1,97 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+/** @file main.cpp
+* Fills the cache of a tile server for an area, without a gui
+* usage: seeder --server NAME --bbox WEST,SOUTH,EAST,NORTH --zoom MIN[-MAX]
+*        [--config tileservers.xml] [--cache FOLDER] [--connections N] [--rate N]
+*/
+
+#include <QtCore>
+#include <iostream>
+#include "tileseeder.h"
+using namespace std;
+
+static int usage()
+{
+	cout<<"usage: seeder --server NAME --bbox WEST,SOUTH,EAST,NORTH --zoom MIN[-MAX]"<<endl
+		<<"              [--config tileservers.xml] [--cache FOLDER] [--connections N] [--rate N]"<<endl
+		<<"  --server       name of the server in the config file"<<endl
+		<<"  --bbox         area in degrees of longitude and latitude"<<endl
+		<<"  --zoom         zoom level or range of zoom levels, up to "<<SEED_MAX_ZOOM<<endl
+		<<"  --config       tile server list (default tileservers.xml)"<<endl
+		<<"  --cache        folder the cache folder goes in (default current folder)"<<endl
+		<<"  --connections  requests in flight (default the server's <connections> times its shards)"<<endl
+		<<"  --rate         requests started per second (default the server's <ratelimit>)"<<endl;
+	return 2;
+}
+
+int main (int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	QStringList args = app.arguments();
+	QHash<QString,QString> options;
+	for (int i=1; i<args.size(); i++)
+	{
+		if (!args.at(i).startsWith("--") || i+1 == args.size())
+		{
+			return usage();
+		}
+		options.insert(args.at(i).mid(2),args.at(i+1));
+		i++;
+	}
+
+	QStringList bbox = options.value("bbox").split(',');
+	QStringList zoom = options.value("zoom").split('-');
+	if (!options.contains("server") || bbox.size() != 4 || zoom.isEmpty() || zoom.size() > 2)
+	{
+		return usage();
+	}
+	bool ok = true;
+	qreal coords[4];
+	for (int i=0; i<4 && ok; i++)
+	{
+		coords[i] = bbox.at(i).toDouble(&ok);
+	}
+	bool minOk, maxOk;
+	int minZoom = zoom.first().toInt(&minOk);
+	int maxZoom = zoom.last().toInt(&maxOk);
+	if (!ok || !minOk || !maxOk || minZoom < 0 || minZoom > maxZoom || maxZoom > SEED_MAX_ZOOM)
+	{
+		return usage();
+	}
+
+	tileSeeder seeder;
+	if (!seeder.setServer(options.value("config","tileservers.xml"),options.value("server")))
+	{
+		return 1;
+	}
+	if (options.contains("cache"))
+	{
+		seeder.setCacheFolder(options.value("cache"));
+	}
+	seeder.setMaxDownloads(options.value("connections").toInt());
+	if (options.contains("rate"))
+	{
+		seeder.setRateLimit(options.value("rate").toDouble());
+	}
+	//x is the longitude and y the latitude, from the south west corner
+	seeder.setArea(QRectF(QPointF(coords[0],coords[1]),QPointF(coords[2],coords[3])),minZoom,maxZoom);
+	//queued, it can finish before the event loop starts if everything is cached
+	QObject::connect(&seeder,SIGNAL(finished()),&app,SLOT(quit()),Qt::QueuedConnection);
+	seeder.start();
+	app.exec();
+	return seeder.getFailures() ? 1 : 0;
+}
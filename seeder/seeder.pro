@@ -0,0 +1,14 @@
+######################################################################
+# Headless tool that fills the tile cache of a server for an area
+######################################################################
+
+TEMPLATE = app
+TARGET = seeder
+CONFIG += qt console
+CONFIG -= app_bundle
+QT += network xml
+DEPENDPATH += . ..
+INCLUDEPATH += ..
+# Input
+HEADERS += tileseeder.h ../servermanager.h ../mercator.h ../tilekey.h ../tilewriter.h ../cacheindex.h ../packstore.h ../metastore.h
+SOURCES += main.cpp tileseeder.cpp ../servermanager.cpp ../mercator.cpp ../tilewriter.cpp ../cacheindex.cpp ../packstore.cpp ../metastore.cpp
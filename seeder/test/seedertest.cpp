@@ -0,0 +1,217 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+/** @file seedertest.cpp
+* QtTest of tileSeeder against the mock tile server of the load test.
+* It seeds the whole world at a few zoom levels into a temporary folder,
+* and checks the files written and that a second run only fetches what's missing.
+* usage: seedertest
+*/
+
+#include <QtTest>
+#include "tileseeder.h"
+#include "mocktileserver.h"
+
+/**
+* longest ms a seeding run may take
+*/
+#define SEED_TIMEOUT 30000
+/**
+* size of the tiles the mock server sends
+*/
+#define SEED_TILE_BYTES 4096
+
+class seederTest : public QObject
+{
+
+Q_OBJECT
+
+private:
+	void writeServers(quint16);
+	bool seed(int, int, quint64 &);
+	int missingTiles(int, int);
+	QString tilePath(int, int, int);
+	static bool removeAll(QString const &);
+
+	QString root;/**< temporary folder everything goes in. */
+	mockTileServer * server;
+
+private slots:
+	void initTestCase();
+	void cleanupTestCase();
+	void seedArea();
+	void resume();
+};
+
+/**
+* Writes a tileservers.xml with a single server pointing to the mock one
+*/
+void seederTest::writeServers(quint16 port)
+{
+	QFile file(root+"/tileservers.xml");
+	QVERIFY(file.open(QIODevice::WriteOnly));
+	QTextStream out(&file);
+	out<<"<cacamap>\n"
+		<<"\t<server>\n"
+		<<"\t\t<name>mock</name>\n"
+		<<"\t\t<url><![CDATA[http://127.0.0.1:"<<port<<"/%z/%x/%y.png]]></url>\n"
+		<<"\t\t<folder>mock</folder>\n"
+		<<"\t\t<filepath><![CDATA[/%z/%x/]]></filepath>\n"
+		<<"\t\t<tile><![CDATA[%y.png]]></tile>\n"
+		<<"\t</server>\n"
+		<<"</cacamap>\n";
+}
+
+/**
+* Seeds the whole world between two zoom levels with a new seeder, like a new run of the tool
+* @param failures gets the number of tiles that couldn't be downloaded
+* @return false if it didn't finish within SEED_TIMEOUT
+*/
+bool seederTest::seed(int minZoom, int maxZoom, quint64 & failures)
+{
+	tileSeeder seeder;
+	if (!seeder.setServer(root+"/tileservers.xml","mock"))
+	{
+		return false;
+	}
+	seeder.setCacheFolder(root);
+	seeder.setArea(QRectF(QPointF(-180,85),QPointF(180,-85)),minZoom,maxZoom);
+	QSignalSpy spy(&seeder,SIGNAL(finished()));
+	QEventLoop loop;
+	connect(&seeder,SIGNAL(finished()),&loop,SLOT(quit()));
+	QTimer::singleShot(SEED_TIMEOUT,&loop,SLOT(quit()));
+	seeder.start();
+	//it finishes right away if everything was cached already
+	if (!spy.count())
+	{
+		loop.exec();
+	}
+	failures = seeder.getFailures();
+	return spy.count() == 1;
+}
+
+/**
+* @return path of a %tile file in the mock server's cache folder
+*/
+QString seederTest::tilePath(int zoom, int x, int y)
+{
+	return QString("%1/cache/mock/%2/%3/%4.png").arg(root).arg(zoom).arg(x).arg(y);
+}
+
+/**
+* @return number of tiles between two zoom levels that aren't in the cache, or are the wrong size
+*/
+int seederTest::missingTiles(int minZoom, int maxZoom)
+{
+	int missing = 0;
+	for (int z = minZoom; z <= maxZoom; z++)
+	{
+		for (int x = 0; x < (1<<z); x++)
+		{
+			for (int y = 0; y < (1<<z); y++)
+			{
+				if (QFileInfo(tilePath(z,x,y)).size() != SEED_TILE_BYTES)
+				{
+					missing++;
+				}
+			}
+		}
+	}
+	return missing;
+}
+
+/**
+* Deletes a folder and everything in it
+*/
+bool seederTest::removeAll(QString const & path)
+{
+	QDir dir(path);
+	QFileInfoList entries = dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot | QDir::Hidden);
+	for (int i=0; i<entries.size(); i++)
+	{
+		if (entries.at(i).isDir())
+		{
+			removeAll(entries.at(i).filePath());
+		}
+		else
+		{
+			QFile::remove(entries.at(i).filePath());
+		}
+	}
+	return dir.rmdir(path);
+}
+
+void seederTest::initTestCase()
+{
+	root = QDir::tempPath()+QString("/cacamap-seedertest-%1").arg(QCoreApplication::applicationPid());
+	QVERIFY(QDir().mkpath(root));
+	mockConfig config;
+	config.latencyMin = 0;
+	config.latencyMax = 0;
+	config.tileBytes = SEED_TILE_BYTES;
+	server = new mockTileServer(config,this);
+	QVERIFY(server->listen(QHostAddress::LocalHost));
+	writeServers(server->serverPort());
+}
+
+void seederTest::cleanupTestCase()
+{
+	delete server;
+	removeAll(root);
+}
+
+/**
+* An empty cache gets every %tile of the area, each one requested once, and a clean index
+*/
+void seederTest::seedArea()
+{
+	quint64 failures = 0;
+	QVERIFY(seed(0,2,failures));
+	QCOMPARE(failures,(quint64)0);
+	QCOMPARE(missingTiles(0,2),0);
+	QCOMPARE(server->getStats().requests,(quint64)(1 + 4 + 16));
+	QVERIFY(QFile::exists(root+"/cache/mock/"+INDEX_FILE));
+}
+
+/**
+* A run that was killed leaves no trustworthy index and maybe some tiles missing.
+* Running it again over a larger area scans the folder and only downloads what's missing.
+*/
+void seederTest::resume()
+{
+	QVERIFY(QFile::remove(root+"/cache/mock/"+INDEX_FILE));
+	QVERIFY(QFile::remove(tilePath(2,1,1)));
+	quint64 before = server->getStats().requests;
+	quint64 failures = 0;
+	QVERIFY(seed(0,3,failures));
+	QCOMPARE(failures,(quint64)0);
+	QCOMPARE(missingTiles(0,3),0);
+	//the deleted tile and the 64 of the new level
+	QCOMPARE(server->getStats().requests - before,(quint64)(1 + 64));
+	QCOMPARE(server->getStats().duplicates,(quint64)1);
+	//and nothing at all once everything is there
+	before = server->getStats().requests;
+	QVERIFY(seed(0,3,failures));
+	QCOMPARE(server->getStats().requests,before);
+}
+
+//the seeder is headless, like the tool it tests
+int main(int argc, char ** argv)
+{
+	QCoreApplication app(argc,argv);
+	seederTest test;
+	return QTest::qExec(&test,argc,argv);
+}
+#include "seedertest.moc"
@@ -0,0 +1,15 @@
+######################################################################
+# QtTest of the seeder against the mock tile server of the load test
+# run with: ./seedertest
+######################################################################
+
+TEMPLATE = app
+TARGET = seedertest
+CONFIG += qt console testcase
+CONFIG -= app_bundle
+QT += network xml testlib
+DEPENDPATH += . .. ../.. ../../loadtest
+INCLUDEPATH += .. ../.. ../../loadtest
+# Input
+HEADERS += ../tileseeder.h ../../loadtest/mocktileserver.h ../../servermanager.h ../../mercator.h ../../tilekey.h ../../tilewriter.h ../../cacheindex.h ../../packstore.h ../../metastore.h
+SOURCES += seedertest.cpp ../tileseeder.cpp ../../loadtest/mocktileserver.cpp ../../servermanager.cpp ../../mercator.cpp ../../tilewriter.cpp ../../cacheindex.cpp ../../packstore.cpp ../../metastore.cpp
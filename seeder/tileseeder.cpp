@@ -0,0 +1,359 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "tileseeder.h"
+#include <iostream>
+using namespace std;
+
+/**
+* constructor
+*/
+tileSeeder::tileSeeder(QObject * _parent):QObject(_parent)
+{
+	manager = new QNetworkAccessManager(this);
+	connect(manager, SIGNAL(finished(QNetworkReply*)),this, SLOT(slotDownloadReady(QNetworkReply*)));
+	rateTimer = new QTimer(this);
+	rateTimer->setSingleShot(true);
+	connect(rateTimer,SIGNAL(timeout()),this,SLOT(slotStartDownloads()));
+	index = 0;
+	pack = 0;
+	meta = 0;
+	folder = QDir::currentPath();
+	currentLevel = 0;
+	cursorx = 0;
+	cursory = 0;
+	maxDownloads = DOWNLOADS_MAX;
+	maxRate = 0;
+	nextStart = 0;
+	lastReport = 0;
+	total = 0;
+	skipped = 0;
+	downloaded = 0;
+	notFound = 0;
+	failed = 0;
+	bytes = 0;
+	done = false;
+}
+
+/**
+* destructor
+*/
+tileSeeder::~tileSeeder()
+{
+	writer.stop();
+	writer.wait();
+	delete index;
+	delete pack;
+	delete meta;
+}
+
+/**
+* Selects the server to download from
+* @param configFile tile server list, same format as tileservers.xml
+* @param name name of the server in the list
+* @return false if the file can't be read or the server isn't in it
+*/
+bool tileSeeder::setServer(QString const & configFile, QString const & name)
+{
+	if (!servermgr.loadConfigFile(configFile))
+	{
+		cout<<"error loading server file "<<configFile.toStdString()<<endl;
+		return false;
+	}
+	int i = servermgr.getServerNames().indexOf(name);
+	if (i < 0)
+	{
+		cout<<"unknown server "<<name.toStdString()<<endl;
+		return false;
+	}
+	servermgr.selectServer(i);
+	//<connections> is per host, and sharded servers have several
+	maxDownloads = servermgr.maxConnections()*servermgr.shardCount();
+	maxRate = servermgr.rateLimit();
+	return true;
+}
+
+/**
+* @param _folder root folder, tiles go in _folder/cache like they do for cacaMap
+*/
+void tileSeeder::setCacheFolder(QString const & _folder)
+{
+	folder = QDir(_folder).absolutePath();
+}
+
+/**
+* Sets the area to download
+* @param bbox longitudes (x) and latitudes (y) in degrees of the area corners.
+* If the west edge is east of the east edge the area crosses the antimeridian.
+* @param minZoom lowest zoom level
+* @param maxZoom highest zoom level, up to SEED_MAX_ZOOM
+*/
+void tileSeeder::setArea(QRectF const & bbox, int minZoom, int maxZoom)
+{
+	levels.clear();
+	total = 0;
+	//mercator can't go all the way to the poles
+	qreal north = qBound(-85.0511,qMax(bbox.top(),bbox.bottom()),85.0511);
+	qreal south = qBound(-85.0511,qMin(bbox.top(),bbox.bottom()),85.0511);
+	qreal west = qBound(-180.0,bbox.left(),180.0);
+	qreal east = qBound(-180.0,bbox.right(),180.0);
+	for (int z = qMax(0,minZoom); z <= qMin(maxZoom,SEED_MAX_ZOOM); z++)
+	{
+		qint64 numtiles = (qint64)1<<z;
+		longPoint topleft = myMercator::geoCoordToPixel(QPointF(west,north),z,256);
+		longPoint bottomright = myMercator::geoCoordToPixel(QPointF(east,south),z,256);
+		seedLevel level;
+		level.zoom = z;
+		//180 degrees east is the right edge of the last column
+		level.left = qMin((qint64)topleft.x/256,numtiles-1);
+		level.right = qMin((qint64)bottomright.x/256,numtiles-1);
+		level.top = qMin((qint64)topleft.y/256,numtiles-1);
+		level.bottom = qMin((qint64)bottomright.y/256,numtiles-1);
+		if (west > east)
+		{
+			level.right += numtiles;
+		}
+		levels.append(level);
+		total += (level.right - level.left + 1)*(level.bottom - level.top + 1);
+	}
+}
+
+/**
+* @param max maximum number of requests in flight, overrides the server's <connections>
+*/
+void tileSeeder::setMaxDownloads(int max)
+{
+	if (max > 0)
+	{
+		maxDownloads = max;
+	}
+}
+
+/**
+* @param requestsPerSec maximum number of requests started per second, 0 for no limit.
+* This overrides the server's <ratelimit>.
+*/
+void tileSeeder::setRateLimit(qreal requestsPerSec)
+{
+	maxRate = qMax((qreal)0,requestsPerSec);
+}
+
+/**
+* @return number of tiles that couldn't be downloaded, not counting the ones the server doesn't have
+*/
+quint64 tileSeeder::getFailures()
+{
+	return failed;
+}
+
+/**
+* Lists what's already cached and starts downloading the rest
+* finished() is emitted when every %tile has been handled.
+*/
+void tileSeeder::start()
+{
+	serverdir = folder+"/cache/"+servermgr.tileCacheFolder();
+	quint64 cacheSize = 0;
+	if (servermgr.packedStorage())
+	{
+		pack = new packStore(serverdir);
+		pack->load(cached,cacheSize);
+	}
+	else
+	{
+		index = new cacheIndex(serverdir);
+		if (!index->load(cached,cacheSize))
+		{
+			index->scan(cached,cacheSize);
+			index->rebuild(cached);
+		}
+	}
+	meta = new metaStore(serverdir);
+	meta->load(metas,metaStore::now());
+	cout<<"seeding "<<total<<" tiles from "<<servermgr.serverName().toStdString()
+		<<" into "<<serverdir.toStdString()<<", "<<cached.size()<<" tiles cached already"<<endl;
+	writer.start();
+	clock.start();
+	currentLevel = 0;
+	if (!levels.isEmpty())
+	{
+		cursorx = levels.at(0).left;
+		cursory = levels.at(0).top;
+	}
+	slotStartDownloads();
+}
+
+/**
+* Moves to the next %tile that isn't cached yet
+* @param key gets the %tile
+* @return false once the whole area has been visited
+*/
+bool tileSeeder::nextTile(tileKey & key)
+{
+	while (currentLevel < levels.size())
+	{
+		seedLevel const & level = levels.at(currentLevel);
+		if (cursorx > level.right)
+		{
+			currentLevel++;
+			if (currentLevel < levels.size())
+			{
+				cursorx = levels.at(currentLevel).left;
+				cursory = levels.at(currentLevel).top;
+			}
+			continue;
+		}
+		qint64 numtiles = (qint64)1<<level.zoom;
+		key = tileKey(level.zoom,cursorx%numtiles,cursory);
+		//columns go one after the other, like the folders they are stored in
+		if (++cursory > level.bottom)
+		{
+			cursory = level.top;
+			cursorx++;
+		}
+		//404s are only asked again once they expire
+		if (cached.contains(key) || metas.value(key).notFound)
+		{
+			skipped++;
+			continue;
+		}
+		return true;
+	}
+	return false;
+}
+
+/**
+* Starts requests until the connection or rate limit is reached
+*/
+void tileSeeder::slotStartDownloads()
+{
+	while (!done && activeDownloads.size() < maxDownloads)
+	{
+		if (maxRate)
+		{
+			qreal wait = nextStart - clock.elapsed();
+			if (wait > 0)
+			{
+				if (!rateTimer->isActive())
+				{
+					rateTimer->start(qCeil(wait));
+				}
+				return;
+			}
+		}
+		tileKey key;
+		if (!nextTile(key))
+		{
+			if (activeDownloads.isEmpty())
+			{
+				finish();
+			}
+			return;
+		}
+		if (maxRate)
+		{
+			nextStart = qMax(nextStart,(qreal)clock.elapsed()) + 1000.0/maxRate;
+		}
+		QNetworkRequest request;
+		request.setUrl(QUrl(servermgr.getTileUrl(key.zoom(),key.x(),key.y())));
+		request.setRawHeader("User-Agent","cacaMap seeder");
+		activeDownloads.insert(manager->get(request),key);
+	}
+}
+
+/**
+* Hands a downloaded %tile to the writer and starts the next request
+*/
+void tileSeeder::slotDownloadReady(QNetworkReply * _reply)
+{
+	tileKey key = activeDownloads.take(_reply);
+	QNetworkReply::NetworkError error = _reply->error();
+	if (error == QNetworkReply::NoError)
+	{
+		QByteArray data = _reply->readAll();
+		if (data.size())
+		{
+			meta->set(key,metaStore::fromReply(_reply,metaStore::now()));
+			downloaded++;
+			bytes += data.size();
+			if (pack)
+			{
+				writer.enqueue(pack,key,data);
+			}
+			else
+			{
+				QString dir = serverdir;
+				servermgr.appendFilePath(dir,key.zoom(),key.x());
+				QString path = dir;
+				servermgr.appendFileName(path,key.y());
+				writer.enqueue(dir,path,data,index,key);
+			}
+		}
+		else
+		{
+			failed++;
+		}
+	}
+	//not worth retrying, an empty area of the map probably
+	else if (error == QNetworkReply::ContentNotFoundError)
+	{
+		meta->set(key,metaStore::fromReply(_reply,metaStore::now()));
+		notFound++;
+	}
+	else
+	{
+		failed++;
+		cout<<"network error: ("<<error<<") "<<_reply->errorString().toStdString()<<endl;
+	}
+	_reply->deleteLater();
+	if (clock.elapsed() - lastReport >= 1000)
+	{
+		lastReport = clock.elapsed();
+		printProgress();
+	}
+	slotStartDownloads();
+}
+
+/**
+* Prints one line with the number of tiles handled so far
+*/
+void tileSeeder::printProgress()
+{
+	quint64 handled = skipped + downloaded + notFound + failed;
+	cout<<handled<<"/"<<total<<" tiles, "<<downloaded<<" downloaded ("<<bytes/1024<<" KB), "
+		<<skipped<<" skipped, "<<notFound<<" not found, "<<failed<<" failed"<<endl;
+}
+
+/**
+* Waits for the writer to save everything and closes the cache so cacaMap can trust it
+*/
+void tileSeeder::finish()
+{
+	done = true;
+	writer.stop();
+	writer.wait();
+	if (index)
+	{
+		index->close();
+	}
+	if (pack)
+	{
+		pack->close();
+	}
+	meta->close();
+	printProgress();
+	cout<<"done in "<<clock.elapsed()/1000.0<<" s"<<endl;
+	emit finished();
+}
@@ -0,0 +1,109 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef TILESEEDER_H
+#define TILESEEDER_H
+
+#include <QtCore>
+#include <QtNetwork>
+#include "servermanager.h"
+#include "mercator.h"
+#include "tilekey.h"
+#include "tilewriter.h"
+#include "cacheindex.h"
+#include "packstore.h"
+#include "metastore.h"
+
+/**
+* highest zoom level that can be seeded, tileKey keeps x and y in 27 bits
+*/
+#define SEED_MAX_ZOOM TILEKEY_MAX_ZOOM
+
+/**
+* range of tiles covering the area at one zoom level
+*/
+struct seedLevel
+{
+	int zoom;/**< zoom level.*/
+	qint64 left;/**< leftmost column, can be past the right one when the area crosses the antimeridian.*/
+	qint64 right;/**< rightmost column, unwrapped.*/
+	qint64 top;/**< topmost row.*/
+	qint64 bottom;/**< bottommost row.*/
+};
+
+/**
+* Downloads every %tile of an area into the cache folder cacaMap reads
+* Tiles that are already cached are skipped, so an interrupted run can simply
+* be started again. Tiles are written by a tileWriter, exactly like cacaMap does.
+*/
+class tileSeeder : public QObject
+{
+
+Q_OBJECT
+
+public:
+	tileSeeder(QObject * _parent=0);
+	~tileSeeder();
+	bool setServer(QString const &, QString const &);
+	void setCacheFolder(QString const &);
+	void setArea(QRectF const &, int, int);
+	void setMaxDownloads(int);
+	void setRateLimit(qreal);
+	void start();
+	quint64 getFailures();
+
+signals:
+	void finished();
+
+private:
+	bool nextTile(tileKey &);
+	void finish();
+	void printProgress();
+
+	servermanager servermgr;
+	QNetworkAccessManager * manager;/**< manages http requests. */
+	tileWriter writer;/**< saves the tiles in the background. */
+	cacheIndex * index;/**< index of the server's cache folder, 0 if it uses pack storage. */
+	packStore * pack;/**< pack store of the server, 0 if it uses one file per %tile. */
+	QHash<tileKey,cacheEntry> cached;/**< tiles that were cached already. */
+	metaStore * meta;/**< HTTP caching information of the server's tiles. */
+	QHash<tileKey,tileMeta> metas;/**< metadata loaded from meta, to skip tiles known to be missing. */
+	QString folder;/**< root folder, the cache goes in folder/cache. */
+	QString serverdir;/**< cache folder of the server. */
+	QVector<seedLevel> levels;/**< tiles to download, by zoom level. */
+	int currentLevel;/**< position in levels of the next %tile. */
+	qint64 cursorx;/**< column of the next %tile, unwrapped. */
+	qint64 cursory;/**< row of the next %tile. */
+	QHash<QNetworkReply*,tileKey> activeDownloads;/**< requests in flight and their %tile. */
+	int maxDownloads;/**< maximum number of requests in flight. */
+	qreal maxRate;/**< maximum requests started per second, 0 for no limit. */
+	qreal nextStart;/**< ms on clock when the next request may start. */
+	QElapsedTimer clock;/**< time since start(). */
+	QTimer * rateTimer;/**< wakes up the seeder when the rate limit allows another request. */
+	qint64 lastReport;/**< ms on clock of the last progress line. */
+	quint64 total;/**< number of tiles in the area. */
+	quint64 skipped;/**< tiles that were already cached. */
+	quint64 downloaded;/**< tiles downloaded. */
+	quint64 notFound;/**< tiles the server doesn't have. */
+	quint64 failed;/**< tiles that couldn't be downloaded. */
+	quint64 bytes;/**< bytes downloaded. */
+	bool done;/**< every %tile has been handled. */
+
+private slots:
+	void slotStartDownloads();
+	void slotDownloadReady(QNetworkReply *);
+};
+
+#endif
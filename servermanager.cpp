@@ -13,6 +13,7 @@ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
 GNU General Public License for more details.
 */
 #include "servermanager.h"
+#include "tilekey.h"
 #include <iostream>
 using namespace std;
 
@@ -94,12 +95,141 @@ bool servermanager::loadConfigFile(QString xmlfile)
 		return 0;
 	}
 
+	//optional, number of simultaneous requests allowed
+	int connections = DOWNLOADS_MAX;
+	QDomNode connectionsnode = server.namedItem("connections");
+	if (!connectionsnode.isNull())
+	{
+		bool ok;
+		int value = connectionsnode.firstChild().toCharacterData().data().toInt(&ok);
+		if (ok && value > 0)
+		{
+			connections = value;
+		}
+		else
+		{
+			cout<<"invalid connections value in xml, using default"<<endl;
+		}
+	}
+
+	//optional, the number of requests in flight adapts to the server up to this
+	int connectionsMax = qMax(connections,DOWNLOADS_MAX);
+	QDomNode maxnode = server.namedItem("maxconnections");
+	if (!maxnode.isNull())
+	{
+		bool ok;
+		int value = maxnode.firstChild().toCharacterData().data().toInt(&ok);
+		if (ok && value > 0)
+		{
+			connectionsMax = value;
+			connections = qMin(connections,value);
+		}
+		else
+		{
+			cout<<"invalid maxconnections value in xml, using default"<<endl;
+		}
+	}
+
+	//optional, requests per second
+	double rateLimit = 0;
+	QDomNode ratenode = server.namedItem("ratelimit");
+	if (!ratenode.isNull())
+	{
+		bool ok;
+		double value = ratenode.firstChild().toCharacterData().data().toDouble(&ok);
+		if (ok && value > 0)
+		{
+			rateLimit = value;
+		}
+		else
+		{
+			cout<<"invalid ratelimit value in xml, ignoring it"<<endl;
+		}
+	}
+
+	//optional, aerial imagery often goes deeper than 18
+	int maxZoom = SERVER_MAX_ZOOM;
+	QDomNode maxzoomnode = server.namedItem("maxzoom");
+	if (!maxzoomnode.isNull())
+	{
+		bool ok;
+		int value = maxzoomnode.firstChild().toCharacterData().data().toInt(&ok);
+		if (ok && value >= 0 && value <= TILEKEY_MAX_ZOOM)
+		{
+			maxZoom = value;
+		}
+		else
+		{
+			cout<<"invalid maxzoom value in xml, using default"<<endl;
+		}
+	}
+
+	//optional, values of %s in the url, one per host
+	QStringList shards;
+	QDomNode shardsnode = server.namedItem("shards");
+	if (!shardsnode.isNull())
+	{
+		shards = shardsnode.firstChild().toCharacterData().data().split(',',QString::SkipEmptyParts);
+		for (int s=0; s<shards.size(); s++)
+		{
+			shards[s] = shards.at(s).trimmed();
+		}
+	}
+	if (urltext.data().contains("%s") && shards.isEmpty())
+	{
+		cout<<"url has %s but there are no shards in xml"<<endl;
+		return 0;
+	}
+
+	//optional, servers with the same tiles, used when the main one is slow
+	QStringList mirrors;
+	for (QDomElement mirror = server.firstChildElement("mirror"); !mirror.isNull(); mirror = mirror.nextSiblingElement("mirror"))
+	{
+		QString mirrorurl = mirror.text().trimmed();
+		if (mirrorurl.isEmpty() || (mirrorurl.contains("%s") && shards.isEmpty()))
+		{
+			cout<<"invalid mirror in xml, ignoring it"<<endl;
+			continue;
+		}
+		mirrors.append(mirrorurl);
+	}
+
+	//optional, how tiles are stored: "files" (default) or "pack"
+	bool packed = false;
+	QDomNode storagenode = server.namedItem("storage");
+	if (!storagenode.isNull())
+	{
+		QString storage = storagenode.firstChild().toCharacterData().data();
+		if (storage == "pack")
+		{
+			packed = true;
+		}
+		else if (storage != "files")
+		{
+			cout<<"unknown storage type in xml, using files"<<endl;
+		}
+	}
+
 	tileserver serveritem;
 	serveritem.name = nametext.data();
 	serveritem.url = urltext.data();
 	serveritem.folder = foldertext.data();
 	serveritem.path = filepathtext.data();
 	serveritem.tile = tiletext.data();
+	serveritem.connections = connections;
+	serveritem.connectionsMax = connectionsMax;
+	serveritem.rateLimit = rateLimit;
+	serveritem.shards = shards;
+	serveritem.packed = packed;
+	serveritem.maxZoom = maxZoom;
+	serveritem.urlTmpl.compile(serveritem.url,shards);
+	serveritem.mirrorTmpls.resize(mirrors.size());
+	for (int m=0; m<mirrors.size(); m++)
+	{
+		serveritem.mirrorTmpls[m].compile(mirrors.at(m),shards);
+	}
+	serveritem.pathTmpl.compile(serveritem.path);
+	serveritem.tileTmpl.compile(serveritem.tile);
 
 	serverlist.append(serveritem);
   }
@@ -107,6 +237,137 @@ bool servermanager::loadConfigFile(QString xmlfile)
   file.close();
   return true;
 }
+/**
+* Parses a template into literal text and %z, %x, %y, %s placeholders
+* @param tmpl template as found in the xml file
+* @param shardList values of %s, if it's empty %s is left as it is
+*/
+void urlTemplate::compile(QString const & tmpl, QStringList const & shardList)
+{
+	segments.clear();
+	shards = shardList;
+	QString literal;
+	for (int i=0; i<tmpl.size(); i++)
+	{
+		templateSegment::segmentType type = templateSegment::LITERAL;
+		if (tmpl.at(i) == '%' && i+1 < tmpl.size())
+		{
+			QChar c = tmpl.at(i+1);
+			if (c == 'z')
+			{
+				type = templateSegment::ZOOM;
+			}
+			else if (c == 'x')
+			{
+				type = templateSegment::X;
+			}
+			else if (c == 'y')
+			{
+				type = templateSegment::Y;
+			}
+			else if (c == 's' && !shards.isEmpty())
+			{
+				type = templateSegment::SHARD;
+			}
+		}
+		if (type == templateSegment::LITERAL)
+		{
+			literal.append(tmpl.at(i));
+			continue;
+		}
+		if (!literal.isEmpty())
+		{
+			templateSegment text;
+			text.type = templateSegment::LITERAL;
+			text.text = literal;
+			segments.append(text);
+			literal.clear();
+		}
+		templateSegment placeholder;
+		placeholder.type = type;
+		segments.append(placeholder);
+		//skip the placeholder letter
+		i++;
+	}
+	if (!literal.isEmpty())
+	{
+		templateSegment text;
+		text.type = templateSegment::LITERAL;
+		text.text = literal;
+		segments.append(text);
+	}
+}
+
+/**
+* Appends the expanded template to out
+*/
+void urlTemplate::expand(QString & out, int zoom, quint32 x, quint32 y) const
+{
+	for (int i=0; i<segments.size(); i++)
+	{
+		templateSegment const & segment = segments.at(i);
+		switch (segment.type)
+		{
+			case templateSegment::LITERAL:
+				out.append(segment.text);
+				break;
+			case templateSegment::ZOOM:
+				appendNumber(out,zoom);
+				break;
+			case templateSegment::X:
+				appendNumber(out,x);
+				break;
+			case templateSegment::Y:
+				appendNumber(out,y);
+				break;
+			case templateSegment::SHARD:
+				out.append(shards.at(shard(x,y)));
+				break;
+		}
+	}
+}
+
+/**
+* Picks the shard of a %tile
+* Neighbouring tiles go to different shards, and a %tile always goes to the
+* same one so the HTTP caches on the way stay useful.
+* @return index of the shard, 0 if there are none
+*/
+int urlTemplate::shard(quint32 x, quint32 y) const
+{
+	if (shards.size() < 2)
+	{
+		return 0;
+	}
+	return (int)(((quint64)x + y) % shards.size());
+}
+
+/**
+* @return number of shards, at least 1
+*/
+int urlTemplate::shardCount() const
+{
+	return qMax(1,shards.size());
+}
+
+/**
+* Appends the decimal digits of n to out, without building a temporary string
+*/
+void urlTemplate::appendNumber(QString & out, quint32 n)
+{
+	char digits[10];
+	int len = 0;
+	do
+	{
+		digits[len++] = '0' + n%10;
+		n/=10;
+	} while (n);
+	while (len)
+	{
+		out.append(QChar(digits[--len]));
+	}
+}
+
 /**
 * Get URL of a specific %tile
 * @param zoom zoom level
@@ -114,16 +375,50 @@ bool servermanager::loadConfigFile(QString xmlfile)
 */
 QString servermanager::getTileUrl(int zoom, quint32 x, quint32 y)
 {
-	QString sz,sx,sy;
-	sz.setNum(zoom);
-	sx.setNum(x);
-	sy.setNum(y);
-	QString urltmpl = serverlist.at(selectedServer).url;
+	QString url;
+	appendTileUrl(url,zoom,x,y);
+	return url;
+}
 
-	urltmpl.replace(QString("%z"),sz);
-	urltmpl.replace(QString("%x"),sx);
-	urltmpl.replace(QString("%y"),sy);
-	return urltmpl;
+/**
+* Appends the URL of a specific %tile to url
+*/
+void servermanager::appendTileUrl(QString & url, int zoom, quint32 x, quint32 y)
+{
+	serverlist.at(selectedServer).urlTmpl.expand(url,zoom,x,y);
+}
+
+/**
+* Get URL of a specific %tile on a mirror of the current server
+* Each %tile always goes to the same mirror, and neighbouring tiles to different ones.
+* @return the url, empty if the server has no mirrors
+*/
+QString servermanager::getMirrorUrl(int zoom, quint32 x, quint32 y)
+{
+	QVector<urlTemplate> const & mirrors = serverlist.at(selectedServer).mirrorTmpls;
+	QString url;
+	if (!mirrors.isEmpty())
+	{
+		mirrors.at(tileMirror(x,y)).expand(url,zoom,x,y);
+	}
+	return url;
+}
+
+/**
+* @return index of the mirror the given %tile goes to, see getMirrorUrl()
+*/
+int servermanager::tileMirror(quint32 x, quint32 y)
+{
+	int mirrors = serverlist.at(selectedServer).mirrorTmpls.size();
+	return mirrors ? (int)(((quint64)x + y) % mirrors) : 0;
+}
+
+/**
+* @return number of mirrors of the current server
+*/
+int servermanager::mirrorCount()
+{
+	return serverlist.at(selectedServer).mirrorTmpls.size();
 }
 
 /**
@@ -139,11 +434,17 @@ QString servermanager::tileCacheFolder()
 */
 QString servermanager::fileName(quint32 y)
 {
-	QString filetmpl = serverlist.at(selectedServer).tile;
-	QString sy;
-	sy.setNum(y);
-	filetmpl.replace("%y",sy);
-	return filetmpl;
+	QString name;
+	appendFileName(name,y);
+	return name;
+}
+
+/**
+* Appends the %tile file name to name
+*/
+void servermanager::appendFileName(QString & name, quint32 y)
+{
+	serverlist.at(selectedServer).tileTmpl.expand(name,0,0,y);
 }
 
 /**
@@ -151,15 +452,75 @@ QString servermanager::fileName(quint32 y)
 */
 QString servermanager::filePath(int zoom, quint32 x)
 {
-	QString filetmpl = serverlist.at(selectedServer).path;
-	QString sz, sx;
-	sz.setNum(zoom);
-	sx.setNum(x);
-	filetmpl.replace("%z",sz);
-	filetmpl.replace("%x",sx);
-	return filetmpl;
+	QString path;
+	appendFilePath(path,zoom,x);
+	return path;
+}
+
+/**
+* Appends the %tile file path to path
+*/
+void servermanager::appendFilePath(QString & path, int zoom, quint32 x)
+{
+	serverlist.at(selectedServer).pathTmpl.expand(path,zoom,x,0);
+}
+
+/**
+* @return number of simultaneous requests to each host of the current server to begin with
+*/
+int servermanager::maxConnections()
+{
+	return serverlist.at(selectedServer).connections;
+}
+
+/**
+* @return most requests in flight to each host of the current server
+*/
+int servermanager::connectionsCeiling()
+{
+	return serverlist.at(selectedServer).connectionsMax;
 }
 
+/**
+* @return requests per second allowed to the current server, 0 for no limit
+*/
+double servermanager::rateLimit()
+{
+	return serverlist.at(selectedServer).rateLimit;
+}
+
+/**
+* @return number of hosts the current server's tiles are spread over
+*/
+int servermanager::shardCount()
+{
+	return serverlist.at(selectedServer).urlTmpl.shardCount();
+}
+
+/**
+* @return index of the host a %tile of the current server is downloaded from
+*/
+int servermanager::tileShard(quint32 x, quint32 y)
+{
+	return serverlist.at(selectedServer).urlTmpl.shard(x,y);
+}
+
+/**
+* @return true if the current server keeps its tiles in pack files
+* @see packStore
+*/
+bool servermanager::packedStorage()
+{
+	return serverlist.at(selectedServer).packed;
+}
+
+/**
+* @return deepest zoom level of the current server
+*/
+int servermanager::maxZoom()
+{
+	return serverlist.at(selectedServer).maxZoom;
+}
 
 /**
 * @return server name
@@ -168,6 +529,14 @@ QString servermanager::serverName()
 {
 	return serverlist.at(selectedServer).name;
 }
+/**
+* @return index of the current server in the list
+*/
+int servermanager::serverIndex()
+{
+	return selectedServer;
+}
+
 /**
 * selects server at index
 */
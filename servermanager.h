@@ -18,6 +18,47 @@ GNU General Public License for more details.
 #define _SRVRMGR
 
 #include <QtXml>
+/**
+* default deepest zoom level of a tile server
+*/
+#define SERVER_MAX_ZOOM 18
+/**
+* default number of simultaneous requests to a tile server
+* it's the same limit QNetworkAccessManager uses per host
+*/
+#define DOWNLOADS_MAX 6
+
+/**
+* Piece of a compiled template, either literal text or a placeholder
+*/
+struct templateSegment
+{
+	enum segmentType {LITERAL, ZOOM, X, Y, SHARD};
+	segmentType type;/**< what this segment expands to*/
+	QString text;/**< the text, only for LITERAL segments*/
+};
+
+/**
+* url/path template with the %z, %x, %y and %s placeholders parsed in advance
+* Expanding it is a single pass of appends into a caller provided string,
+* which doesn't allocate if the string has enough capacity reserved.
+* %s is only a placeholder if the template has shards, it's replaced by the
+* shard of the %tile, so each %tile always comes from the same host.
+*/
+class urlTemplate
+{
+public:
+	void compile(QString const &, QStringList const & shardList=QStringList());
+	void expand(QString &, int, quint32, quint32) const;
+	int shard(quint32, quint32) const;
+	int shardCount() const;
+
+private:
+	static void appendNumber(QString &, quint32);
+	QVector<templateSegment> segments;/**< literal text and placeholders, in order*/
+	QStringList shards;/**< values of %s*/
+};
+
 struct tileserver
 {
 	QString name;/**<name of the tile server*/
@@ -25,6 +66,16 @@ struct tileserver
 	QString folder;/**< name of folder where tiles will be stored*/
 	QString path;/**< path where tiles will be stored*/
 	QString tile;/**< tile file*/ 
+	int connections;/**< number of requests in flight to each shard to begin with*/
+	int connectionsMax;/**< max number of requests in flight to each shard*/
+	double rateLimit;/**< max requests per second, 0 for no limit*/
+	QStringList shards;/**< values of %s in the url, usually subdomains*/
+	bool packed;/**< tiles are kept in pack files instead of one file per tile*/
+	int maxZoom;/**< deepest zoom level the server has*/
+	urlTemplate urlTmpl;/**< compiled url*/
+	QVector<urlTemplate> mirrorTmpls;/**< compiled urls of mirrors serving the same tiles*/
+	urlTemplate pathTmpl;/**< compiled path*/
+	urlTemplate tileTmpl;/**< compiled tile*/
 };
 
 class servermanager
@@ -32,12 +83,26 @@ class servermanager
 public:
 	bool loadConfigFile(QString);
 	QString getTileUrl(int,quint32,quint32);
+	void appendTileUrl(QString &,int,quint32,quint32);
+	QString getMirrorUrl(int,quint32,quint32);
+	int mirrorCount();
+	int tileMirror(quint32,quint32);
+	void appendFilePath(QString &,int,quint32);
+	void appendFileName(QString &,quint32);
 	QString tileCacheFolder();
 	//returns the filename of the file as it should be stored in HD
 	QString fileName(quint32);
 	void selectServer(int);
 	QString serverName();
+	int serverIndex();
 	QString filePath(int, quint32);
+	int maxConnections();
+	int connectionsCeiling();
+	double rateLimit();
+	int shardCount();
+	int tileShard(quint32,quint32);
+	bool packedStorage();
+	int maxZoom();
 	QStringList getServerNames();
 
 private:
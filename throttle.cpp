@@ -0,0 +1,216 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#include "throttle.h"
+
+/**
+* constructor
+* @param initial requests in flight allowed to each host to begin with
+* @param _ceiling most requests in flight the window can grow to
+* @param _rate requests/s allowed, 0 for no limit. Up to one second worth can be sent at once.
+*/
+downloadThrottle::downloadThrottle(int initial, int _ceiling, double _rate)
+{
+	ceiling = qMax(1,_ceiling);
+	window = qBound(1,initial,ceiling);
+	baseLatency = 0;
+	avgLatency = 0;
+	lastDecrease = -1;
+	rate = qMax(0.0,_rate);
+	tokens = qMax(1.0,rate);
+	lastRefill = 0;
+	pausedUntil = 0;
+	hedgeCredit = 0;
+	sinceDecay = 0;
+	//different for every client and server, otherwise they would all retry at the same "random" times
+	jitter = ((quint64)QDateTime::currentDateTime().toTime_t()<<32) ^ ((quint64)QCoreApplication::applicationPid()<<16) ^ (quint64)(quintptr)this;
+	if (!jitter)
+	{
+		jitter = 1;
+	}
+}
+
+/**
+* @return requests in flight allowed to each host right now
+*/
+int downloadThrottle::limit() const
+{
+	return (int)window;
+}
+
+/**
+* @param now current time
+* @return ms until the next request can be sent, 0 if it can be sent now
+*/
+qint64 downloadThrottle::wait(qint64 now) const
+{
+	if (now < pausedUntil)
+	{
+		return pausedUntil - now;
+	}
+	if (!rate)
+	{
+		return 0;
+	}
+	double available = qMin(qMax(1.0,rate),tokens + (now - lastRefill)*rate/1000);
+	if (available >= 1)
+	{
+		return 0;
+	}
+	return (qint64)qCeil((1 - available)*1000/rate);
+}
+
+/**
+* Uses up a token for a request that is being sent, and earns a bit of hedging budget
+*/
+void downloadThrottle::take(qint64 now)
+{
+	//a few can be saved up for a burst of slow answers
+	hedgeCredit = qMin((double)HEDGE_BUDGET,hedgeCredit + HEDGE_BUDGET/100.0);
+	if (rate)
+	{
+		refill(now);
+		tokens -= 1;
+	}
+}
+
+/**
+* Tops up the bucket with the tokens earned since the last time
+*/
+void downloadThrottle::refill(qint64 now)
+{
+	tokens = qMin(qMax(1.0,rate),tokens + (now - lastRefill)*rate/1000);
+	lastRefill = now;
+}
+
+/**
+* A request was answered
+* @param latency us from sending the request to its last byte
+*/
+void downloadThrottle::success(qint64 latency)
+{
+	addLatency(latency);
+	if (!baseLatency || latency < baseLatency)
+	{
+		baseLatency = latency;
+	}
+	else
+	{
+		//a server that got slower for good shouldn't keep the window shut forever
+		baseLatency += (latency - baseLatency)/256;
+	}
+	avgLatency = avgLatency ? avgLatency + (latency - avgLatency)/8 : latency;
+	if (avgLatency <= baseLatency*THROTTLE_LATENCY_TOLERANCE && window < ceiling)
+	{
+		//one more request every window's worth of answers
+		window = qMin((double)ceiling,window + 1/window);
+	}
+}
+
+/**
+* A request was given up on because a hedged duplicate answered first
+* Only the hedging threshold learns from it, the request wasn't answered.
+* @param elapsed us since it was sent, its latency would have been at least that
+*/
+void downloadThrottle::abandoned(qint64 elapsed)
+{
+	addLatency(elapsed);
+}
+
+/**
+* Adds an answer to the latencies the hedging threshold comes from
+*/
+void downloadThrottle::addLatency(qint64 latency)
+{
+	if (++sinceDecay >= HEDGE_WINDOW)
+	{
+		latencies.decay();
+		sinceDecay = 0;
+	}
+	latencies.add(latency);
+}
+
+/**
+* The server pushed back, the window is halved
+* The answers to the requests in flight when that happened are likely to push
+* back too, so it's done at most once per round trip.
+*/
+void downloadThrottle::congestion(qint64 now)
+{
+	if (lastDecrease >= 0 && now - lastDecrease < avgLatency/1000)
+	{
+		return;
+	}
+	lastDecrease = now;
+	window = qMax(1.0,window/2);
+}
+
+/**
+* No requests are sent until then (Retry-After)
+*/
+void downloadThrottle::pause(qint64 until)
+{
+	pausedUntil = qMax(pausedUntil,until);
+}
+
+/**
+* @return us after which a request should be hedged, -1 if too few have been answered to tell
+*/
+qint64 downloadThrottle::hedgeDelay() const
+{
+	if (latencies.count() < HEDGE_MIN_SAMPLES)
+	{
+		return -1;
+	}
+	return qMax((qint64)HEDGE_DELAY_MIN*1000,(qint64)latencies.percentile(HEDGE_PERCENTILE));
+}
+
+/**
+* Uses up the budget for a hedged request
+* @return false if the budget is spent
+*/
+bool downloadThrottle::takeHedge()
+{
+	if (hedgeCredit < 1)
+	{
+		return false;
+	}
+	hedgeCredit -= 1;
+	return true;
+}
+
+/**
+* Delay before a retry, doubling with each attempt
+* Half of it is random, so failed requests don't all come back at the same time.
+* @param retries number of times the request has been retried already
+* @return ms to wait
+*/
+qint64 downloadThrottle::backoff(int retries)
+{
+	qint64 delay = qMin((qint64)RETRY_DELAY_MAX,(qint64)RETRY_DELAY<<qMin(retries,16));
+	return delay/2 + (qint64)(nextRandom()%(quint64)(delay/2 + 1));
+}
+
+/**
+* @return next number of the jitter generator (xorshift64)
+* It's private so the application's qrand() sequence isn't disturbed.
+*/
+quint64 downloadThrottle::nextRandom()
+{
+	jitter ^= jitter<<13;
+	jitter ^= jitter>>7;
+	jitter ^= jitter<<17;
+	return jitter;
+}
@@ -0,0 +1,104 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <QtCore>
+#include "mapmetrics.h"
+
+/**
+* the average latency may be this many times the lowest seen before the window stops growing
+*/
+#define THROTTLE_LATENCY_TOLERANCE 1.5
+/**
+* first retry of a failed request is after about this many ms, doubling every time
+*/
+#define RETRY_DELAY 500
+/**
+* longest ms between retries
+*/
+#define RETRY_DELAY_MAX 60000
+/**
+* number of times a failed request is retried before giving up on it
+*/
+#define RETRY_MAX 5
+/**
+* percent of extra requests allowed for hedging
+*/
+#define HEDGE_BUDGET 5
+/**
+* requests slower than this fraction of the rest get a hedged duplicate
+*/
+#define HEDGE_PERCENTILE 0.95
+/**
+* answers needed before the latency percentile is trusted
+*/
+#define HEDGE_MIN_SAMPLES 20
+/**
+* answers after which the older latencies count half, so the hedging threshold follows the server
+*/
+#define HEDGE_WINDOW 256
+/**
+* a request is never hedged before this many ms
+*/
+#define HEDGE_DELAY_MIN 100
+
+/**
+* Adaptive concurrency and rate limit of requests to a tile server
+* The number of requests in flight (the window) grows by one every window's worth
+* of answers while latency stays close to the lowest seen, and it's halved when the
+* server pushes back (429, 503, timeouts), at most once per round trip.
+* On top of that a token bucket caps the requests per second, and the server can
+* ask for a pause with Retry-After. Times are ms on a clock the caller provides.
+* It also decides when a slow request is worth duplicating on a mirror, keeping
+* the duplicates to HEDGE_BUDGET percent of the requests.
+*/
+class downloadThrottle
+{
+public:
+	downloadThrottle(int, int, double);
+	int limit() const;
+	qint64 wait(qint64) const;
+	void take(qint64);
+	void success(qint64);
+	void abandoned(qint64);
+	void congestion(qint64);
+	void pause(qint64);
+	qint64 hedgeDelay() const;
+	bool takeHedge();
+	qint64 backoff(int);
+
+private:
+	void refill(qint64);
+	void addLatency(qint64);
+	quint64 nextRandom();
+
+	double window;/**< requests in flight allowed to each host. */
+	int ceiling;/**< window never grows beyond this. */
+	qint64 baseLatency;/**< us, lowest latency seen, drifting up slowly so it follows the server. */
+	qint64 avgLatency;/**< us, moving average of the latency. */
+	qint64 lastDecrease;/**< when the window was last halved. */
+	double rate;/**< requests/s allowed, 0 for no limit. */
+	double tokens;/**< requests that can be sent right away. */
+	qint64 lastRefill;/**< when tokens was last topped up. */
+	qint64 pausedUntil;/**< no requests until then, because of a Retry-After. */
+	histogram latencies;/**< us, of the recent answers, for the hedging threshold. */
+	int sinceDecay;/**< answers added to latencies since it was last decayed. */
+	quint64 jitter;/**< state of the generator of the retry delays' random part, never 0. */
+	double hedgeCredit;/**< hedged requests that can be sent, grows with every request. */
+};
+
+#endif
@@ -0,0 +1,65 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef TILEKEY_H
+#define TILEKEY_H
+
+#include <QtGlobal>
+
+/**
+* deepest zoom level a tileKey can hold, x and y have 27 bits
+*/
+#define TILEKEY_MAX_ZOOM 27
+
+/**
+* Packed 64 bit id of a %tile
+* From the most significant bit: server index (5 bits), zoom (5 bits), x (27 bits), y (27 bits).
+* The server index is only needed when tiles of different servers share a container.
+*/
+struct tileKey
+{
+	quint64 id;/**< packed server, zoom, x and y. */
+
+	tileKey():id(0){}
+	tileKey(int zoom, quint32 x, quint32 y, int server=0)
+	{
+		id = ((quint64)(server & 0x1f)<<59) | ((quint64)(zoom & 0x1f)<<54)
+			| ((quint64)(x & 0x7ffffff)<<27) | (quint64)(y & 0x7ffffff);
+	}
+	int server() const { return (int)(id>>59); }
+	int zoom() const { return (int)((id>>54) & 0x1f); }
+	quint32 x() const { return (quint32)((id>>27) & 0x7ffffff); }
+	quint32 y() const { return (quint32)(id & 0x7ffffff); }
+	bool operator==(tileKey const & other) const { return id == other.id; }
+	bool operator!=(tileKey const & other) const { return id != other.id; }
+	bool operator<(tileKey const & other) const { return id < other.id; }
+};
+
+/**
+* Hash function for QHash/QSet/QCache
+* Mixes all the bits (murmur3 finalizer) so neighbouring tiles spread over the buckets.
+*/
+inline uint qHash(tileKey const & key)
+{
+	quint64 h = key.id;
+	h ^= h >> 33;
+	h *= Q_UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= Q_UINT64_C(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+	return (uint)h;
+}
+
+#endif
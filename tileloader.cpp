@@ -0,0 +1,114 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+#include "tileloader.h"
+
+/**
+* constructor, the %tile will be read from a file
+*/
+tileLoader::tileLoader(QObject * _receiver, quint64 _key, QString const & _fileName)
+{
+	receiver = _receiver;
+	key = _key;
+	fileName = _fileName;
+	pack = 0;
+}
+
+/**
+* constructor, the %tile is decoded from data already in memory (e.g. just downloaded)
+*/
+tileLoader::tileLoader(QObject * _receiver, quint64 _key, QByteArray const & _data)
+{
+	receiver = _receiver;
+	key = _key;
+	data = _data;
+	pack = 0;
+}
+
+/**
+* constructor, the %tile is decoded from a pack store
+*/
+tileLoader::tileLoader(QObject * _receiver, quint64 _key, packStore * _pack, tileKey _packKey)
+{
+	receiver = _receiver;
+	key = _key;
+	pack = _pack;
+	packKey = _packKey;
+}
+
+/**
+* Reads and decodes the image. Runs in a QThreadPool thread.
+* A null image is delivered if the file can't be read or decoded, and
+* with it how long reading (-1 if nothing was read) and decoding took in us.
+*/
+void tileLoader::run()
+{
+	QImage image;
+	int readTime = -1;
+	int decodeTime = 0;
+	QElapsedTimer clock;
+	clock.start();
+	if (pack)
+	{
+		//the pack is mapped in memory, reading happens as it's decoded
+		image = pack->decode(packKey);
+	}
+	else
+	{
+		if (data.isEmpty())
+		{
+			QFile f(fileName);
+			if (f.open(QIODevice::ReadOnly))
+			{
+				data = f.readAll();
+				f.close();
+			}
+			readTime = clock.nsecsElapsed()/1000;
+			clock.restart();
+		}
+		if (!data.isEmpty())
+		{
+			image.loadFromData(data);
+		}
+	}
+	decodeTime = clock.nsecsElapsed()/1000;
+	QMetaObject::invokeMethod(receiver, "slotTileDecoded", Qt::QueuedConnection,
+		Q_ARG(qulonglong, key), Q_ARG(QImage, image), Q_ARG(int, readTime), Q_ARG(int, decodeTime));
+}
+
+/**
+* constructor
+*/
+tileEncoder::tileEncoder(QObject * _receiver, quint64 _key, QImage const & _image)
+{
+	receiver = _receiver;
+	key = _key;
+	image = _image;
+}
+
+/**
+* Encodes the image. Runs in a QThreadPool thread.
+*/
+void tileEncoder::run()
+{
+	QByteArray data;
+	QBuffer buffer(&data);
+	buffer.open(QIODevice::WriteOnly);
+	if (!image.save(&buffer,"PNG"))
+	{
+		data.clear();
+	}
+	QMetaObject::invokeMethod(receiver, "slotTileEncoded", Qt::QueuedConnection,
+		Q_ARG(qulonglong, key), Q_ARG(QByteArray, data));
+}
@@ -0,0 +1,64 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef TILELOADER_H
+#define TILELOADER_H
+
+#include <QtGui>
+#include "packstore.h"
+
+/**
+* Reads and decodes a %tile image in a worker thread
+* The result is handed back to the GUI thread by invoking
+* receiver's slotTileDecoded(qulonglong,QImage,int,int) as a queued call.
+* @see cacaMap::loadTile()
+*/
+class tileLoader : public QRunnable
+{
+public:
+	tileLoader(QObject *, quint64, QString const &);
+	tileLoader(QObject *, quint64, QByteArray const &);
+	tileLoader(QObject *, quint64, packStore *, tileKey);
+	void run();
+
+private:
+	QObject * receiver;/**< object the decoded image is delivered to. */
+	quint64 key;/**< id of the %tile in the in-memory cache (a packed tileKey). */
+	QString fileName;/**< file to read the %tile from, empty if data is used. */
+	QByteArray data;/**< encoded image, if it's already in memory. */
+	packStore * pack;/**< store to decode the %tile from, if it's not 0. */
+	tileKey packKey;/**< id of the %tile in pack. */
+};
+
+/**
+* Encodes a %tile image as PNG in a worker thread
+* The result is handed back to the GUI thread by invoking
+* receiver's slotTileEncoded(qulonglong,QByteArray) as a queued call,
+* the data is empty if it couldn't be encoded.
+* @see cacaMap::saveComposite()
+*/
+class tileEncoder : public QRunnable
+{
+public:
+	tileEncoder(QObject *, quint64, QImage const &);
+	void run();
+
+private:
+	QObject * receiver;/**< object the encoded data is delivered to. */
+	quint64 key;/**< id of the %tile in the in-memory cache (a packed tileKey). */
+	QImage image;/**< image to encode. */
+};
+
+#endif
@@ -0,0 +1,355 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+#include "tilewriter.h"
+#include <cstdio>
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <iostream>
+using namespace std;
+
+/**
+* constructor
+*/
+tileWriter::tileWriter(QObject * parent):QThread(parent)
+{
+	stopping = false;
+	nextGeneration = 0;
+}
+
+/**
+* destructor, writes whatever is still queued before returning
+*/
+tileWriter::~tileWriter()
+{
+	stop();
+	wait();
+}
+
+/**
+* Queues a file to be written
+* If the same file is queued twice only the latest data is written.
+* Once the file is queued to be deleted, a new write is ordered after the removal.
+* @param dir folder where the file goes
+* @param path full path of the file
+* @param data file contents
+* @param index if not 0 the %tile is added to it once the file is written
+* @param key the %tile
+*/
+void tileWriter::enqueue(QString const & dir, QString const & path, QByteArray const & data, cacheIndex * index, tileKey key)
+{
+	QMutexLocker locker(&mutex);
+	if (!pendingData.contains(path))
+	{
+		writeJob job;
+		job.dir = dir;
+		job.path = path;
+		job.index = index;
+		job.pack = 0;
+		job.metas = 0;
+		job.key = key;
+		job.remove = false;
+		job.generation = nextGeneration++;
+		queue.append(job);
+		pendingData[path].generation = job.generation;
+	}
+	pendingData[path].data = data;
+	hasWork.wakeOne();
+}
+
+/**
+* Queues a %tile to be added to a pack store
+* @param pack the store
+* @param key the %tile
+* @param data file contents
+*/
+void tileWriter::enqueue(packStore * pack, tileKey key, QByteArray const & data)
+{
+	QString path = pack->jobPath(key);
+	QMutexLocker locker(&mutex);
+	if (!pendingData.contains(path))
+	{
+		writeJob job;
+		job.path = path;
+		job.index = 0;
+		job.pack = pack;
+		job.metas = 0;
+		job.key = key;
+		job.remove = false;
+		job.generation = nextGeneration++;
+		queue.append(job);
+		pendingData[path].generation = job.generation;
+	}
+	pendingData[path].data = data;
+	hasWork.wakeOne();
+}
+
+/**
+* Queues a %tile file to be deleted
+* If it's still waiting to be written it won't be.
+* @param path full path of the file
+* @param index if not 0 the %tile is removed from it
+* @param key the %tile
+*/
+void tileWriter::enqueueRemove(QString const & path, cacheIndex * index, tileKey key)
+{
+	QMutexLocker locker(&mutex);
+	pendingData.remove(path);
+	writeJob job;
+	job.path = path;
+	job.index = index;
+	job.pack = 0;
+	job.metas = 0;
+	job.key = key;
+	job.remove = true;
+	job.generation = 0;
+	queue.append(job);
+	hasWork.wakeOne();
+}
+
+/**
+* Queues a %tile to be removed from a pack store
+*/
+void tileWriter::enqueueRemove(packStore * pack, tileKey key)
+{
+	QString path = pack->jobPath(key);
+	QMutexLocker locker(&mutex);
+	pendingData.remove(path);
+	writeJob job;
+	job.path = path;
+	job.index = 0;
+	job.pack = pack;
+	job.metas = 0;
+	job.key = key;
+	job.remove = true;
+	job.generation = 0;
+	queue.append(job);
+	hasWork.wakeOne();
+}
+
+/**
+* Queues the metadata record of a %tile
+* Records are written in the order they are queued, the last one wins.
+*/
+void tileWriter::enqueueMeta(metaStore * metas, tileKey key, tileMeta const & meta)
+{
+	QMutexLocker locker(&mutex);
+	writeJob job;
+	job.index = 0;
+	job.pack = 0;
+	job.metas = metas;
+	job.meta = meta;
+	job.key = key;
+	job.remove = false;
+	job.generation = 0;
+	queue.append(job);
+	hasWork.wakeOne();
+}
+
+/**
+* Queues the removal of the metadata of a %tile
+*/
+void tileWriter::enqueueMetaRemove(metaStore * metas, tileKey key)
+{
+	QMutexLocker locker(&mutex);
+	writeJob job;
+	job.index = 0;
+	job.pack = 0;
+	job.metas = metas;
+	job.key = key;
+	job.remove = true;
+	job.generation = 0;
+	queue.append(job);
+	hasWork.wakeOne();
+}
+
+/**
+* @return contents of a file that is queued but not written yet, empty if there is none
+*/
+QByteArray tileWriter::pending(QString const & path)
+{
+	QMutexLocker locker(&mutex);
+	return pendingData.value(path).data;
+}
+
+/**
+* Tells the thread to finish, the queue is written out before it exits
+*/
+void tileWriter::stop()
+{
+	QMutexLocker locker(&mutex);
+	stopping = true;
+	hasWork.wakeOne();
+}
+
+/**
+* Thread loop, takes all queued jobs at once and writes them
+*/
+void tileWriter::run()
+{
+	forever
+	{
+		mutex.lock();
+		while (queue.isEmpty() && !stopping)
+		{
+			hasWork.wait(&mutex);
+		}
+		if (queue.isEmpty())
+		{
+			mutex.unlock();
+			break;
+		}
+		QList<writeJob> batch = queue;
+		queue.clear();
+		mutex.unlock();
+
+		//create the folders of the whole batch first, each one only once
+		for (int i=0; i<batch.size(); i++)
+		{
+			QString const & dir = batch.at(i).dir;
+			if (!dir.isEmpty() && !knownDirs.contains(dir))
+			{
+				if (!QDir().mkpath(dir))
+				{
+					cout<<"couldn't create folder "<<dir.toStdString()<<endl;
+				}
+				knownDirs.insert(dir);
+			}
+		}
+		QSet<packStore*> packs;
+		for (int i=0; i<batch.size(); i++)
+		{
+			QString const & path = batch.at(i).path;
+			if (batch.at(i).metas)
+			{
+				if (batch.at(i).remove)
+				{
+					batch.at(i).metas->remove(batch.at(i).key);
+				}
+				else
+				{
+					batch.at(i).metas->set(batch.at(i).key,batch.at(i).meta);
+				}
+				continue;
+			}
+			if (batch.at(i).remove)
+			{
+				if (batch.at(i).pack)
+				{
+					batch.at(i).pack->remove(batch.at(i).key);
+					packs.insert(batch.at(i).pack);
+				}
+				else
+				{
+					QFile::remove(path);
+					if (batch.at(i).index)
+					{
+						batch.at(i).index->remove(batch.at(i).key);
+					}
+				}
+				continue;
+			}
+			mutex.lock();
+			QHash<QString,pendingFile>::const_iterator pending = pendingData.constFind(path);
+			//it was removed before it got written, if it was queued again
+			//that job comes after the removal and writes the new data
+			bool queued = pending != pendingData.constEnd() && pending.value().generation == batch.at(i).generation;
+			QByteArray data = queued ? pending.value().data : QByteArray();
+			mutex.unlock();
+			if (!queued)
+			{
+				continue;
+			}
+
+			if (batch.at(i).pack)
+			{
+				batch.at(i).pack->write(batch.at(i).key,data);
+				packs.insert(batch.at(i).pack);
+			}
+			else if (writeFile(path,data) && batch.at(i).index)
+			{
+				batch.at(i).index->append(batch.at(i).key,data.size());
+			}
+
+			mutex.lock();
+			//it's only done if no newer data came in while writing,
+			//if it was removed and queued again meanwhile the newer job is already queued
+			pending = pendingData.constFind(path);
+			if (pending != pendingData.constEnd() && pending.value().generation == batch.at(i).generation)
+			{
+				if (pending.value().data.constData() == data.constData())
+				{
+					pendingData.remove(path);
+				}
+				else
+				{
+					writeJob job = batch.at(i);
+					queue.append(job);
+				}
+			}
+			mutex.unlock();
+		}
+		//reclaim the space of replaced and removed tiles
+		foreach (packStore * pack, packs)
+		{
+			pack->compact();
+		}
+	}
+}
+
+/**
+* Writes a file atomically: data goes to a temp file which is then renamed over the target
+* @return true if succesful false otherwise
+*/
+bool tileWriter::writeFile(QString const & path, QByteArray const & data)
+{
+	QString tmppath = path+".tmp";
+	QFile f(tmppath);
+	if (!f.open(QIODevice::WriteOnly))
+	{
+		cout<<"couldn't open file "<<tmppath.toStdString()<<endl;
+		return false;
+	}
+	qint64 byteswritten = f.write(data);
+	//the data has to reach the disk before the rename, or a crash could leave an empty file
+	bool synced = f.flush();
+#ifdef Q_OS_WIN
+	synced = synced && _commit(f.handle()) == 0;
+#else
+	synced = synced && fsync(f.handle()) == 0;
+#endif
+	f.close();
+	if (byteswritten != data.size() || !synced || f.error() != QFile::NoError)
+	{
+		cout<<"error writing to file "<<tmppath.toStdString()<<endl;
+		QFile::remove(tmppath);
+		return false;
+	}
+	//rename() replaces the target atomically on POSIX
+	if (std::rename(QFile::encodeName(tmppath).constData(),QFile::encodeName(path).constData()) != 0)
+	{
+		//windows doesn't replace existing files
+		QFile::remove(path);
+		if (!QFile::rename(tmppath,path))
+		{
+			cout<<"couldn't rename "<<tmppath.toStdString()<<endl;
+			QFile::remove(tmppath);
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,85 @@
+/*
+Copyright 2010 Jean Fairlie jmfairlie@gmail.com
+
+This file is part of CacaMap
+CacaMap is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+*/
+
+#ifndef TILEWRITER_H
+#define TILEWRITER_H
+
+#include <QtCore>
+#include "cacheindex.h"
+#include "packstore.h"
+#include "metastore.h"
+
+/**
+* A %tile waiting to be written
+*/
+struct writeJob
+{
+	QString dir;/**< folder the file goes in, created if needed. Empty for pack jobs. */
+	QString path;/**< full path of the file, or packStore::jobPath(). */
+	cacheIndex * index;/**< index the %tile is added to once written, can be 0. */
+	packStore * pack;/**< if not 0 the %tile goes in this pack store instead of a file. */
+	metaStore * metas;/**< if not 0 it's a metadata record of the %tile for this store instead. */
+	tileMeta meta;/**< the metadata record, unless remove is set. */
+	tileKey key;/**< the %tile. */
+	bool remove;/**< the %tile has to be deleted instead of written. */
+	quint64 generation;/**< tells this write apart from later ones of the same path. */
+};
+
+/**
+* Contents of a queued file, and the write job they belong to
+*/
+struct pendingFile
+{
+	QByteArray data;/**< file contents. */
+	quint64 generation;/**< writeJob::generation of the job that writes them. */
+};
+
+/**
+* Background thread that saves downloaded tiles to HDD, and deletes evicted ones
+* Files are written to a temp file, synced to disk and then renamed, so a crash never
+* leaves a truncated %tile behind. Tiles of servers using pack storage are
+* appended to their packStore, which is compacted when needed. The HTTP metadata
+* of the tiles is written to their metaStore here too.
+*/
+class tileWriter : public QThread
+{
+public:
+	tileWriter(QObject * _parent=0);
+	~tileWriter();
+	void enqueue(QString const &, QString const &, QByteArray const &, cacheIndex * _index=0, tileKey _key=tileKey());
+	void enqueue(packStore *, tileKey, QByteArray const &);
+	void enqueueRemove(QString const &, cacheIndex *, tileKey);
+	void enqueueRemove(packStore *, tileKey);
+	void enqueueMeta(metaStore *, tileKey, tileMeta const &);
+	void enqueueMetaRemove(metaStore *, tileKey);
+	QByteArray pending(QString const &);
+	void stop();
+
+protected:
+	void run();
+
+private:
+	bool writeFile(QString const &, QByteArray const &);
+
+	QMutex mutex;/**< guards everything below. */
+	QWaitCondition hasWork;/**< signaled when a job is queued or the thread has to stop. */
+	QList<writeJob> queue;/**< files waiting to be written or deleted, in arrival order. */
+	QHash<QString,pendingFile> pendingData;/**< contents of the queued files, by path. */
+	quint64 nextGeneration;/**< generation given to the next write job. */
+	QSet<QString> knownDirs;/**< folders that are known to exist already. */
+	bool stopping;/**< the thread should exit once the queue is empty. */
+};
+
+#endif